@@ -1,28 +1,226 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sndfile.h>
 #include <portaudio.h>
 #include "audio.h"
 
 
+// lock-free queue for passing items from one producer thread to one consumer thread
+template<typename T, int N>
+class SPSCQueue {
+    T                   items[N];
+
+    std::atomic<int>    head=0;     // next item to pop, advanced by the consumer
+    std::atomic<int>    tail=0;     // next item to push, advanced by the producer
+
+public:
+    bool push(T&& item)
+    {
+        const int t=tail.load(std::memory_order_relaxed);
+        if ((t+1)%N==head.load(std::memory_order_acquire))
+            return false;
+
+        items[t]=std::move(item);
+        tail.store((t+1)%N, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        const int h=head.load(std::memory_order_relaxed);
+        if (h==tail.load(std::memory_order_acquire))
+            return false;
+
+        item=std::move(items[h]);
+        head.store((h+1)%N, std::memory_order_release);
+        return true;
+    }
+};
+
+
+// common base of all devices, which hands providers to the audio thread and keeps statistics about it
 class AudioDevice:public IAudioDevice {
 public:
-    AudioDevice();
     virtual ~AudioDevice();
 
     virtual void play(std::shared_ptr<IAudioProvider>) override;
 
+    virtual void remove(VoiceId) override;
+    virtual void set_gain(VoiceId, float gain) override;
+
+    virtual Statistics get_statistics() const override;
+    virtual void reset_statistics() override;
+
+protected:
+    AudioDevice(int samplerate);
+
+    virtual void add_voice(VoiceId, std::shared_ptr<IAudioProvider>, float gain) override;
+
+    // mixes the output of all providers on the audio thread, returning whether any provider was playing
+    bool process(float* output, unsigned long count, bool underflow=false);
+
+    // for devices without underflow reporting of their own, to be called on the audio thread
+    void report_underflow();
+
+    int         samplerate;
+    double      latency=0.0;
+
+    // set by derived classes once the audio thread is running
+    bool        running=false;
+
 private:
-    PaStream*   stream;
-    int         phase=0;
+    /* Counters updated by the audio thread only, with times in nanoseconds. Resetting is left to the audio thread
+     * as well, so that no update is lost in between. */
+    std::atomic<unsigned long>  callbacks=0;
+    std::atomic<unsigned long>  underflows=0;
+    std::atomic<uint64_t>       totalcallbacktime=0;
+    std::atomic<uint64_t>       maxcallbacktime=0;
+    std::atomic<double>         maxload=0.0;
+    std::atomic<bool>           resetrequested=false;
 
-    std::shared_ptr<IAudioProvider> current_provider;
+    struct Command {
+        enum class Type {
+            Play,
+            Add,
+            Remove,
+            SetGain
+        };
 
-    void process(float* output, unsigned long count);
+        Type                            type;
+        std::shared_ptr<IAudioProvider> provider;   // for Play and Add
+        VoiceId                         id;         // for all but Play
+        float                           gain;
+    };
+
+    struct Voice {
+        std::shared_ptr<IAudioProvider> provider;
+        VoiceId                         id;
+        float                           gain;
+        float                           targetgain; // approached over one mix block to avoid clicks
+    };
+
+    static constexpr int    maxvoices=16;
+    static constexpr int    queuesize=16;
+    static constexpr long   mixblock=256;
+
+    /* The audio thread must not free providers, since their destructors may block or release memory. Providers
+     * are therefore handed to it through a queue, and handed back once done with for destruction by the next call
+     * from the user interface. Each provider is retired exactly once, and send() hands over no more providers than
+     * are collected back plus the usable capacity of the queue below, so retiring a provider never fails. */
+    SPSCQueue<Command, queuesize>                                   commands;
+    SPSCQueue<std::shared_ptr<IAudioProvider>, maxvoices+queuesize> retired;
+
+    // providers handed to the audio thread and not collected back yet, only accessed by the user interface
+    int         handedover=0;
+
+    // only accessed by the audio thread
+    Voice       voices[maxvoices];
+    int         nvoices=0;
+    float       mixbuffer[mixblock];
+
+    void send(Command&&);
+    void execute(Command&);
+    void retire(int voice);
+    void retire(std::shared_ptr<IAudioProvider>&&);
+    void collect_retired();
+    void update_statistics(uint64_t elapsed, unsigned long count, bool underflow);
+};
+
+
+class PortAudioDevice:public AudioDevice {
+public:
+    PortAudioDevice(const Config&);
+    virtual ~PortAudioDevice();
+
+    virtual Statistics get_statistics() const override;
+
+    bool is_open() const
+    {
+        return stream!=nullptr;
+    }
+
+private:
+    PaStream*   stream=nullptr;
 
     static int callback(const void* input, void* output, unsigned long count, const PaStreamCallbackTimeInfo* timeinfo, PaStreamCallbackFlags flags, void* userdata);
 };
 
 
+// consumes the output in real time without playing it, paced by the system clock
+class NullAudioDevice:public AudioDevice {
+public:
+    NullAudioDevice(const Config&);
+    virtual ~NullAudioDevice();
+
+private:
+    unsigned long       buffersize;
+
+    std::atomic<bool>   stopping=false;
+    std::thread         thread;
+
+    void run();
+};
+
+
+// forwards to a device which is being opened on a background thread, holding back all calls until it is open
+class AsyncAudioDevice:public IAudioDevice {
+public:
+    AsyncAudioDevice(const Config&);
+    virtual ~AsyncAudioDevice();
+
+    virtual void play(std::shared_ptr<IAudioProvider>) override;
+
+    virtual void remove(VoiceId) override;
+    virtual void set_gain(VoiceId, float gain) override;
+
+    virtual Statistics get_statistics() const override;
+    virtual void reset_statistics() override;
+
+protected:
+    virtual void add_voice(VoiceId, std::shared_ptr<IAudioProvider>, float gain) override;
+
+private:
+    mutable std::mutex                                  mutex;
+    std::unique_ptr<IAudioDevice>                       device;
+    std::vector<std::function<void(IAudioDevice&)>>     pending;
+
+    std::thread                                         opener;
+
+    void forward(std::function<void(IAudioDevice&)>&&);
+};
+
+
+/* Writes the output to a WAV file as fast as it can be rendered. Buffers are only written while a provider is
+ * playing, so the file contains everything played back to back, without the pauses in between. */
+class WaveFileAudioDevice:public AudioDevice {
+public:
+    WaveFileAudioDevice(const Config&);
+    virtual ~WaveFileAudioDevice();
+
+    bool is_open() const
+    {
+        return sf!=nullptr;
+    }
+
+private:
+    unsigned long       buffersize;
+    SNDFILE*            sf=nullptr;
+
+    std::atomic<bool>   stopping=false;
+    std::thread         thread;
+
+    void run();
+};
+
+
 IAudioProvider::~IAudioProvider()
 {
 }
@@ -39,29 +237,338 @@ IAudioDevice::~IAudioDevice()
 }
 
 
-IAudioDevice* IAudioDevice::create()
+IAudioDevice::VoiceId IAudioDevice::add(std::shared_ptr<IAudioProvider> provider, float gain)
 {
-    PaError err=Pa_Initialize();
-    
-    if (err!=paNoError) {
-        fprintf(stderr, "PortAudio: %s\n", Pa_GetErrorText(err));
-        return nullptr;
+    static std::atomic<VoiceId> lastid=0;
+
+    const VoiceId id=++lastid;
+    add_voice(id, std::move(provider), gain);
+
+    return id;
+}
+
+
+IAudioDevice::Config IAudioDevice::Config::from_environment()
+{
+    Config config;
+
+    if (const char* device=getenv("MEOW_AUDIO_DEVICE")) {
+        if (!strcmp(device, "null"))
+            config.type=Type::Null;
+        else if (!strncmp(device, "file:", 5)) {
+            config.type=Type::WaveFile;
+            config.filename=device+5;
+        }
+        else
+            config.device=device;
     }
-    
-    return new AudioDevice();
+
+    if (const char* buffersize=getenv("MEOW_AUDIO_BUFFERSIZE"))
+        config.buffersize=strtoul(buffersize, nullptr, 10);
+
+    if (const char* latency=getenv("MEOW_AUDIO_LATENCY"))
+        config.latency=atof(latency);
+
+    if (getenv("MEOW_AUDIO_STATS"))
+        config.statistics=true;
+
+    return config;
 }
 
 
-AudioDevice::AudioDevice()
+IAudioDevice* IAudioDevice::create(const Config& config)
 {
-    PaError err=Pa_OpenDefaultStream(
+    if (config.type==Type::WaveFile) {
+        WaveFileAudioDevice* dev=new WaveFileAudioDevice(config);
+        if (dev->is_open())
+            return dev;
+
+        delete dev;
+    }
+    else if (config.type==Type::PortAudio) {
+        PaError err=Pa_Initialize();
+        
+        if (err==paNoError) {
+            PortAudioDevice* dev=new PortAudioDevice(config);
+            if (dev->is_open())
+                return dev;
+
+            delete dev;
+        }
+        else
+            fprintf(stderr, "PortAudio: %s\n", Pa_GetErrorText(err));
+    }
+
+    // without a usable output, everything still works, just without sound
+    if (config.type!=Type::Null)
+        fprintf(stderr, "Falling back to null audio device\n");
+
+    return new NullAudioDevice(config);
+}
+
+
+IAudioDevice* IAudioDevice::create_async(const Config& config)
+{
+    return new AsyncAudioDevice(config);
+}
+
+
+AudioDevice::AudioDevice(int samplerate):samplerate(samplerate)
+{
+}
+
+
+AudioDevice::~AudioDevice()
+{
+    collect_retired();
+}
+
+
+void AudioDevice::play(std::shared_ptr<IAudioProvider> provider)
+{
+    send({ Command::Type::Play, std::move(provider), 0, 1.0f });
+}
+
+
+void AudioDevice::add_voice(VoiceId id, std::shared_ptr<IAudioProvider> provider, float gain)
+{
+    send({ Command::Type::Add, std::move(provider), id, gain });
+}
+
+
+void AudioDevice::remove(VoiceId id)
+{
+    send({ Command::Type::Remove, nullptr, id, 0.0f });
+}
+
+
+void AudioDevice::set_gain(VoiceId id, float gain)
+{
+    send({ Command::Type::SetGain, nullptr, id, gain });
+}
+
+
+void AudioDevice::send(Command&& cmd)
+{
+    collect_retired();
+
+    if (!running) return;
+
+    // the provider of a dropped command is released right here, on the user interface thread
+    if (cmd.provider && handedover==maxvoices+queuesize-1) {
+        fprintf(stderr, "AudioDevice: too many providers, dropping command\n");
+        return;
+    }
+
+    const bool handover=cmd.provider!=nullptr;
+
+    if (!commands.push(std::move(cmd)))
+        fprintf(stderr, "AudioDevice: audio thread not responding, dropping command\n");
+    else if (handover)
+        handedover++;
+}
+
+
+IAudioDevice::Statistics AudioDevice::get_statistics() const
+{
+    Statistics stats;
+
+    stats.callbacks       =callbacks;
+    stats.underflows      =underflows;
+    stats.meancallbacktime=stats.callbacks ? totalcallbacktime*1e-9/stats.callbacks : 0.0;
+    stats.maxcallbacktime =maxcallbacktime*1e-9;
+    stats.maxload         =maxload;
+    stats.latency         =latency;
+
+    return stats;
+}
+
+
+void AudioDevice::reset_statistics()
+{
+    resetrequested=true;
+}
+
+
+void AudioDevice::collect_retired()
+{
+    std::shared_ptr<IAudioProvider> provider;
+    while (retired.pop(provider)) {
+        provider=nullptr;
+        handedover--;
+    }
+}
+
+
+// the methods below run on the audio thread, so shared pointers are only ever moved there and never released
+
+void AudioDevice::execute(Command& cmd)
+{
+    switch (cmd.type) {
+    case Command::Type::Play:
+        while (nvoices>0)
+            retire(nvoices-1);
+
+        if (!cmd.provider)
+            break;
+
+        [[fallthrough]];
+    case Command::Type::Add:
+        if (nvoices<maxvoices)
+            voices[nvoices++]={ std::move(cmd.provider), cmd.id, cmd.gain, cmd.gain };
+        else
+            retire(std::move(cmd.provider));
+        break;
+    case Command::Type::Remove:
+        for (int i=0;i<nvoices;i++)
+            if (voices[i].id==cmd.id) {
+                retire(i);
+                break;
+            }
+        break;
+    case Command::Type::SetGain:
+        for (int i=0;i<nvoices;i++)
+            if (voices[i].id==cmd.id)
+                voices[i].targetgain=cmd.gain;
+        break;
+    }
+}
+
+
+void AudioDevice::retire(std::shared_ptr<IAudioProvider>&& provider)
+{
+    [[maybe_unused]] const bool pushed=retired.push(std::move(provider));
+    assert(pushed);
+}
+
+
+void AudioDevice::retire(int voice)
+{
+    retire(std::move(voices[voice].provider));
+
+    if (voice!=--nvoices)
+        voices[voice]=std::move(voices[nvoices]);
+}
+
+
+bool AudioDevice::process(float* output, unsigned long count, bool underflow)
+{
+    const auto start=std::chrono::steady_clock::now();
+
+    for (Command cmd; commands.pop(cmd);)
+        execute(cmd);
+
+    const bool playing=nvoices>0;
+
+    std::fill(output, output+count, 0.0f);
+
+    for (unsigned long offset=0; offset<count && nvoices>0; offset+=mixblock) {
+        const unsigned long length=std::min<unsigned long>(mixblock, count-offset);
+
+        for (int i=0;i<nvoices;) {
+            Voice& voice=voices[i];
+
+            // providers may return fewer samples than requested before they are finished
+            unsigned long done=0;
+            while (done<length) {
+                const unsigned long n=voice.provider->provide(mixbuffer+done, length-done);
+                assert(n<=length-done);
+
+                if (!n) break;
+                done+=n;
+            }
+
+            const float step=(voice.targetgain - voice.gain) / length;
+            for (unsigned long j=0;j<done;j++)
+                output[offset+j]+=mixbuffer[j] * (voice.gain + step*j);
+
+            voice.gain=voice.targetgain;
+
+            if (done<length)
+                retire(i);
+            else
+                i++;
+        }
+    }
+
+    const uint64_t elapsed=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    update_statistics(elapsed, count, underflow);
+
+    return playing;
+}
+
+
+void AudioDevice::report_underflow()
+{
+    underflows.store(underflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+
+// runs on the audio thread, which is the only one writing the counters
+void AudioDevice::update_statistics(uint64_t elapsed, unsigned long count, bool underflow)
+{
+    if (resetrequested.exchange(false)) {
+        callbacks=0;
+        underflows=0;
+        totalcallbacktime=0;
+        maxcallbacktime=0;
+        maxload=0.0;
+    }
+
+    callbacks.store(callbacks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (underflow)
+        report_underflow();
+
+    totalcallbacktime.store(totalcallbacktime.load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+
+    if (elapsed>maxcallbacktime.load(std::memory_order_relaxed))
+        maxcallbacktime.store(elapsed, std::memory_order_relaxed);
+
+    if (count) {
+        const double load=elapsed*1e-9 * samplerate / count;
+
+        if (load>maxload.load(std::memory_order_relaxed))
+            maxload.store(load, std::memory_order_relaxed);
+    }
+}
+
+
+PortAudioDevice::PortAudioDevice(const Config& config):AudioDevice(config.samplerate)
+{
+    PaStreamParameters params;
+    params.device=Pa_GetDefaultOutputDevice();
+    params.channelCount=1;
+    params.sampleFormat=paFloat32;
+    params.hostApiSpecificStreamInfo=nullptr;
+
+    if (!config.device.empty()) {
+        for (PaDeviceIndex i=0;i<Pa_GetDeviceCount();i++) {
+            const PaDeviceInfo* info=Pa_GetDeviceInfo(i);
+
+            if (info && info->maxOutputChannels>0 && strstr(info->name, config.device.c_str())) {
+                params.device=i;
+                break;
+            }
+        }
+    }
+
+    const PaDeviceInfo* info=params.device!=paNoDevice ? Pa_GetDeviceInfo(params.device) : nullptr;
+    if (!info) {
+        fprintf(stderr, "PortAudio: no output device\n");
+        return;
+    }
+
+    params.suggestedLatency=config.latency>0.0 ? config.latency : info->defaultLowOutputLatency;
+
+    PaError err=Pa_OpenStream(
         &stream,
-        0,  // no input
-        1,  // mono output
-        paFloat32,
-        48000,
-        paFramesPerBufferUnspecified,
-        &AudioDevice::callback,
+        nullptr,    // no input
+        &params,
+        config.samplerate,
+        config.buffersize ? config.buffersize : paFramesPerBufferUnspecified,
+        paNoFlag,
+        &PortAudioDevice::callback,
         this);
 
     if (err!=paNoError) {
@@ -70,47 +577,197 @@ AudioDevice::AudioDevice()
         return;
     }
 
+    if (const PaStreamInfo* streaminfo=Pa_GetStreamInfo(stream))
+        latency=streaminfo->outputLatency;
+
+    running=true;
+
     Pa_StartStream(stream);
 }
 
 
-AudioDevice::~AudioDevice()
+PortAudioDevice::~PortAudioDevice()
 {
-    Pa_AbortStream(stream);
-    Pa_CloseStream(stream);
+    if (stream) {
+        Pa_AbortStream(stream);
+        Pa_CloseStream(stream);
+    }
+
     Pa_Terminate();
 }
 
 
-void AudioDevice::play(std::shared_ptr<IAudioProvider> provider)
+IAudioDevice::Statistics PortAudioDevice::get_statistics() const
 {
-    current_provider=provider;
+    Statistics stats=AudioDevice::get_statistics();
+
+    if (stream)
+        stats.cpuload=Pa_GetStreamCpuLoad(stream);
+
+    return stats;
 }
 
 
-void AudioDevice::process(float* output, unsigned long count)
+int PortAudioDevice::callback(const void* input, void* output, unsigned long count, const PaStreamCallbackTimeInfo* timeinfo, PaStreamCallbackFlags flags, void* userdata)
 {
-    while (current_provider && count) {
-        unsigned long done=current_provider->provide(output, count);
-        assert(done<=count);
+    reinterpret_cast<PortAudioDevice*>(userdata)->process(reinterpret_cast<float*>(output), count, flags & paOutputUnderflow);
 
-        if (!done) {
-            current_provider=nullptr;
-            break;
+    return paContinue;
+}
+
+
+AsyncAudioDevice::AsyncAudioDevice(const Config& config)
+{
+    opener=std::thread([this, config]() {
+        IAudioDevice* dev=IAudioDevice::create(config);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        device=std::unique_ptr<IAudioDevice>(dev);
+
+        for (auto& call: pending)
+            call(*device);
+
+        pending.clear();
+    });
+}
+
+
+AsyncAudioDevice::~AsyncAudioDevice()
+{
+    opener.join();
+}
+
+
+void AsyncAudioDevice::play(std::shared_ptr<IAudioProvider> provider)
+{
+    forward([provider](IAudioDevice& dev) { dev.play(provider); });
+}
+
+
+void AsyncAudioDevice::add_voice(VoiceId id, std::shared_ptr<IAudioProvider> provider, float gain)
+{
+    forward([id, provider, gain](IAudioDevice& dev) { dev.add_voice(id, provider, gain); });
+}
+
+
+void AsyncAudioDevice::remove(VoiceId id)
+{
+    forward([id](IAudioDevice& dev) { dev.remove(id); });
+}
+
+
+void AsyncAudioDevice::set_gain(VoiceId id, float gain)
+{
+    forward([id, gain](IAudioDevice& dev) { dev.set_gain(id, gain); });
+}
+
+
+IAudioDevice::Statistics AsyncAudioDevice::get_statistics() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return device ? device->get_statistics() : Statistics();
+}
+
+
+void AsyncAudioDevice::reset_statistics()
+{
+    forward([](IAudioDevice& dev) { dev.reset_statistics(); });
+}
+
+
+void AsyncAudioDevice::forward(std::function<void(IAudioDevice&)>&& call)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (device)
+        call(*device);
+    else
+        pending.push_back(std::move(call));
+}
+
+
+NullAudioDevice::NullAudioDevice(const Config& config):AudioDevice(config.samplerate)
+{
+    buffersize=config.buffersize ? config.buffersize : 512;
+
+    running=true;
+
+    thread=std::thread(&NullAudioDevice::run, this);
+}
+
+
+NullAudioDevice::~NullAudioDevice()
+{
+    stopping=true;
+    thread.join();
+}
+
+
+void NullAudioDevice::run()
+{
+    std::vector<float> buffer(buffersize);
+
+    const auto period=std::chrono::nanoseconds(buffersize * 1000000000 / samplerate);
+    auto next=std::chrono::steady_clock::now();
+
+    while (!stopping) {
+        process(buffer.data(), buffersize);
+
+        // falling behind the clock counts as an underflow, as it would on a real device
+        next+=period;
+
+        if (next<std::chrono::steady_clock::now()) {
+            next=std::chrono::steady_clock::now();
+            report_underflow();
         }
 
-        output+=done;
-        count -=done;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+
+WaveFileAudioDevice::WaveFileAudioDevice(const Config& config):AudioDevice(config.samplerate)
+{
+    buffersize=config.buffersize ? config.buffersize : 512;
+
+    SF_INFO sfinfo;
+    sfinfo.samplerate=config.samplerate;
+    sfinfo.channels=1;
+    sfinfo.format=SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+
+    sf=sf_open(config.filename.c_str(), SFM_WRITE, &sfinfo);
+    if (!sf) {
+        fprintf(stderr, "%s: %s\n", config.filename.c_str(), sf_strerror(nullptr));
+        return;
     }
 
-    while (count--)
-        *output++=0.0f;
+    running=true;
+
+    thread=std::thread(&WaveFileAudioDevice::run, this);
 }
 
 
-int AudioDevice::callback(const void* input, void* output, unsigned long count, const PaStreamCallbackTimeInfo* timeinfo, PaStreamCallbackFlags flags, void* userdata)
+WaveFileAudioDevice::~WaveFileAudioDevice()
 {
-    reinterpret_cast<AudioDevice*>(userdata)->process(reinterpret_cast<float*>(output), count);
+    if (!sf) return;
 
-    return paContinue;
+    stopping=true;
+    thread.join();
+
+    sf_close(sf);
+}
+
+
+void WaveFileAudioDevice::run()
+{
+    std::vector<float> buffer(buffersize);
+
+    while (!stopping) {
+        if (process(buffer.data(), buffersize))
+            sf_write_float(sf, buffer.data(), buffersize);
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
 }
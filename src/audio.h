@@ -1,6 +1,9 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <string>
 
 
 class IAudioProvider {
@@ -12,15 +15,73 @@ public:
     void terminate();
 
 protected:
-    bool    terminating=false;
+    // set from the user interface while the provider may be running on the audio thread
+    std::atomic<bool>   terminating=false;
 };
 
 
 class IAudioDevice {
 public:
+    enum class Type {
+        PortAudio,
+        Null,       // discards the output in real time
+        WaveFile    // writes the output to a file as fast as it is rendered
+    };
+
+    struct Config {
+        Type            type=Type::PortAudio;
+        std::string     device;             // (part of) the name of the output device, or empty for the default device
+        std::string     filename;           // output file of the WaveFile device
+        int             samplerate=48000;
+        unsigned long   buffersize=0;       // frames per buffer, or 0 to let PortAudio choose
+        double          latency=0.0;        // suggested output latency in seconds, or 0 for the device's default low latency
+        bool            statistics=false;   // whether the user of the device should report its statistics
+
+        /* Defaults, overridden by the environment variables MEOW_AUDIO_DEVICE, MEOW_AUDIO_BUFFERSIZE, MEOW_AUDIO_LATENCY
+         * and MEOW_AUDIO_STATS, which enables statistics when set to anything. MEOW_AUDIO_DEVICE may also be "null" or
+         * "file:" followed by a file name to select the respective device type. */
+        static Config from_environment();
+    };
+
+    struct Statistics {
+        unsigned long   callbacks=0;
+        unsigned long   underflows=0;       // callbacks reporting an output underflow
+        double          meancallbacktime=0.0;
+        double          maxcallbacktime=0.0;
+        double          maxload=0.0;        // largest callback time relative to the duration of its buffer
+        double          cpuload=0.0;        // as estimated by PortAudio
+        double          latency=0.0;        // output latency of the stream
+    };
+
+    // handle of a provider added to the mix, which is unique within the process and never refers to another provider
+    typedef uint64_t VoiceId;
+
     virtual ~IAudioDevice();
 
+    // replaces everything playing by the given provider, or stops all playback if it is null
     virtual void play(std::shared_ptr<IAudioProvider>) = 0;
 
-    static IAudioDevice* create();
+    // mixes the given provider with those already playing until it is finished or removed
+    VoiceId add(std::shared_ptr<IAudioProvider>, float gain=1.0f);
+
+    // voices which have finished already are ignored; gain changes are smoothed to avoid clicks
+    virtual void remove(VoiceId) = 0;
+    virtual void set_gain(VoiceId, float gain) = 0;
+
+    // times are given in seconds
+    virtual Statistics get_statistics() const = 0;
+    virtual void reset_statistics() = 0;
+
+    // falls back to a null device if the requested device cannot be opened, so this never fails
+    static IAudioDevice* create(const Config& =Config::from_environment());
+
+    /* Returns immediately and opens the device on a background thread, since enumerating the outputs of some
+     * audio backends takes a noticeable amount of time. Until it is open, everything played is held back. */
+    static IAudioDevice* create_async(const Config& =Config::from_environment());
+
+protected:
+    friend class AsyncAudioDevice;
+
+    // adds a provider under a handle allocated by add()
+    virtual void add_voice(VoiceId, std::shared_ptr<IAudioProvider>, float gain) = 0;
 };
@@ -0,0 +1,336 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include "compression.h"
+
+
+enum class BlockMethod:uint8_t {
+    Verbatim    =0,
+    Predicted   =1
+};
+
+const int max_prediction_order=4;
+const int partition_size=256;
+
+// keeps the residuals of all predictors well within 32 bits
+const int32_t max_sample_magnitude=1<<24;
+
+
+class BitWriter {
+    std::vector<uint8_t>&   out;
+    uint64_t                acc=0;
+    int                     nbits=0;
+
+public:
+    BitWriter(std::vector<uint8_t>& out):out(out) {}
+
+    // writes the lowest n bits of value, for n up to 32
+    void write(uint32_t value, int n)
+    {
+        acc=(acc<<n) | (value & ((uint64_t(1)<<n)-1));
+        nbits+=n;
+
+        while (nbits>=8) {
+            nbits-=8;
+            out.push_back(uint8_t(acc>>nbits));
+        }
+    }
+
+    // q zeros followed by a one
+    void write_unary(uint32_t q)
+    {
+        for (;q>=32;q-=32)
+            write(0, 32);
+
+        write(1, q+1);
+    }
+
+    void flush()
+    {
+        if (nbits>0)
+            write(0, 8-nbits);
+    }
+};
+
+
+class BitReader {
+    const uint8_t*  data;
+    size_t          size;
+    size_t          pos=0;
+
+    uint64_t        acc=0;      // only the lowest nbits are valid, which are kept below 64
+    int             nbits=0;
+
+    void refill()
+    {
+        while (nbits<=48 && pos<size) {
+            acc=(acc<<8) | data[pos++];
+            nbits+=8;
+        }
+    }
+
+public:
+    bool            overrun=false;
+
+    BitReader(const uint8_t* data, size_t size):data(data), size(size) {}
+
+    // reads n bits, for n up to 32, with zeros past the end of the data
+    uint32_t read(int n)
+    {
+        if (nbits<n) {
+            refill();
+
+            if (nbits<n) {
+                acc<<=n-nbits;
+                nbits=n;
+                overrun=true;
+            }
+        }
+
+        nbits-=n;
+        return uint32_t((acc>>nbits) & ((uint64_t(1)<<n)-1));
+    }
+
+    // counts zeros up to the next one, which is consumed as well
+    bool read_unary(uint32_t& q)
+    {
+        for (q=0;;) {
+            if (!nbits) {
+                refill();
+
+                if (!nbits) {
+                    overrun=true;
+                    return false;
+                }
+            }
+
+            const uint64_t window=acc & ((uint64_t(1)<<nbits)-1);
+
+            if (window) {
+                const int zeros=nbits-1 - (63-__builtin_clzll(window));
+                q+=zeros;
+                nbits-=zeros+1;
+                return true;
+            }
+
+            q+=nbits;
+            nbits=0;
+        }
+    }
+};
+
+
+static uint32_t zigzag(int32_t r)
+{
+    return (uint32_t(r)<<1) ^ uint32_t(r>>31);
+}
+
+
+static int32_t unzigzag(uint32_t u)
+{
+    return int32_t(u>>1) ^ -int32_t(u&1);
+}
+
+
+// fixed polynomial predictors as used by FLAC, falling back to lower orders at the start of the block
+static int32_t predict(const int32_t* x, int i, int order)
+{
+    switch (std::min(order, i)) {
+    case 0:
+        return 0;
+    case 1:
+        return x[i-1];
+    case 2:
+        return 2*x[i-1] - x[i-2];
+    case 3:
+        return 3*x[i-1] - 3*x[i-2] + x[i-3];
+    default:
+        return 4*x[i-1] - 6*x[i-2] + 4*x[i-3] - x[i-4];
+    }
+}
+
+
+/* Returns the smallest shift which turns all samples into integers of limited magnitude, or -1 if there is none.
+ * Negative zero is not representable as an integer either, and neither are infinities and NaNs. */
+static int find_integer_shift(const float* samples, int count)
+{
+    int shift=0;
+
+    for (int i=0;i<count;i++) {
+        const float x=samples[i];
+
+        if (x==0.0f) {
+            if (signbit(x)) return -1;
+            continue;
+        }
+
+        if (!isfinite(x)) return -1;
+
+        int exponent;
+        int32_t mantissa=int32_t(ldexpf(frexpf(x, &exponent), 24));
+        exponent-=24;
+
+        while (!(mantissa&1)) {
+            mantissa/=2;
+            exponent++;
+        }
+
+        shift=std::max(shift, -exponent);
+    }
+
+    if (shift>31) return -1;
+
+    for (int i=0;i<count;i++)
+        if (fabsf(ldexpf(samples[i], shift))>max_sample_magnitude)
+            return -1;
+
+    return shift;
+}
+
+
+static void compress_verbatim(std::vector<uint8_t>& out, const float* samples, int count)
+{
+    out.push_back(uint8_t(BlockMethod::Verbatim));
+
+    const uint8_t* bytes=reinterpret_cast<const uint8_t*>(samples);
+    out.insert(out.end(), bytes, bytes + count*sizeof(float));
+}
+
+
+void compress_block(std::vector<uint8_t>& out, const float* samples, int count)
+{
+    const int shift=find_integer_shift(samples, count);
+    if (shift<0 || count>compression_block_size) {
+        compress_verbatim(out, samples, count);
+        return;
+    }
+
+    int32_t values[compression_block_size];
+    for (int i=0;i<count;i++)
+        values[i]=int32_t(ldexpf(samples[i], shift));
+
+    // the predictor order minimizing the magnitude of the residual tends to minimize its coded size as well
+    int order=0;
+    uint64_t bestsum=UINT64_MAX;
+
+    for (int o=0;o<=max_prediction_order;o++) {
+        uint64_t sum=0;
+        for (int i=0;i<count;i++)
+            sum+=zigzag(values[i] - predict(values, i, o));
+
+        if (sum<bestsum) {
+            bestsum=sum;
+            order=o;
+        }
+    }
+
+    uint32_t residual[compression_block_size];
+    for (int i=0;i<count;i++)
+        residual[i]=zigzag(values[i] - predict(values, i, order));
+
+    const size_t start=out.size();
+    out.push_back(uint8_t(BlockMethod::Predicted));
+    out.push_back(uint8_t(shift));
+    out.push_back(uint8_t(order));
+
+    BitWriter bits(out);
+
+    // each partition gets its own Rice parameter, estimated from the mean residual and refined on the exact code size
+    for (int p=0;p<count;p+=partition_size) {
+        const int n=std::min(partition_size, count-p);
+
+        uint64_t sum=0;
+        for (int i=0;i<n;i++)
+            sum+=residual[p+i];
+
+        int estimate=0;
+        while (estimate<30 && (uint64_t(n)<<(estimate+1))<=sum)
+            estimate++;
+
+        int k=0;
+        uint64_t bestsize=UINT64_MAX;
+
+        for (int c=std::max(estimate-1, 0); c<=std::min(estimate+1, 30); c++) {
+            uint64_t size=uint64_t(n)*(c+1);
+            for (int i=0;i<n;i++)
+                size+=residual[p+i]>>c;
+
+            if (size<bestsize) {
+                bestsize=size;
+                k=c;
+            }
+        }
+
+        bits.write(k, 5);
+
+        for (int i=0;i<n;i++) {
+            bits.write_unary(residual[p+i]>>k);
+            bits.write(residual[p+i], k);
+        }
+    }
+
+    bits.flush();
+
+    // noise may not be worth predicting
+    if (out.size()-start > 1 + count*sizeof(float)) {
+        out.resize(start);
+        compress_verbatim(out, samples, count);
+    }
+}
+
+
+bool decompress_block(float* samples, int count, const uint8_t* data, size_t size)
+{
+    if (size<1 || count>compression_block_size)
+        return false;
+
+    switch (BlockMethod(data[0])) {
+    case BlockMethod::Verbatim:
+        if (size!=1 + count*sizeof(float))
+            return false;
+
+        memcpy(samples, data+1, count*sizeof(float));
+        return true;
+    case BlockMethod::Predicted:
+        break;
+    default:
+        return false;
+    }
+
+    if (size<3)
+        return false;
+
+    const int shift=data[1];
+    const int order=data[2];
+    if (shift>31 || order>max_prediction_order)
+        return false;
+
+    BitReader bits(data+3, size-3);
+
+    int32_t values[compression_block_size];
+
+    for (int p=0;p<count;p+=partition_size) {
+        const int n=std::min(partition_size, count-p);
+        const int k=bits.read(5);
+
+        for (int i=p;i<p+n;i++) {
+            uint32_t q;
+            if (!bits.read_unary(q) || q>(UINT32_MAX>>k))
+                return false;
+
+            const int64_t value=int64_t(predict(values, i, order)) + unzigzag((q<<k) | bits.read(k));
+            if (value<-max_sample_magnitude || value>max_sample_magnitude)
+                return false;
+
+            values[i]=int32_t(value);
+        }
+    }
+
+    if (bits.overrun)
+        return false;
+
+    for (int i=0;i<count;i++)
+        samples[i]=ldexpf(float(values[i]), -shift);
+
+    return true;
+}
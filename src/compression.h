@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+/* Lossless compression of sample data in blocks which can be decoded independently of each other. Samples read from
+ * integer PCM files are integer multiples of a power of two, so blocks for which this holds are coded as the residual
+ * of a fixed polynomial predictor, using Rice codes. Any other block, e.g. from a floating point file, is stored as is. */
+constexpr int compression_block_size=4096;
+
+// appends the encoded block of count samples to out
+void compress_block(std::vector<uint8_t>& out, const float* samples, int count);
+
+// decodes a block of count samples, returning false if the data is malformed
+bool decompress_block(float* samples, int count, const uint8_t* data, size_t size);
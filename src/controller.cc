@@ -1,7 +1,6 @@
 #include <algorithm>
 #include <cstdio>
 #include "controller.h"
-#include "render.h"
 
 
 template<typename T>
@@ -20,7 +19,14 @@ T unlerp(T a, T b, T y)
 
 Controller::Controller(Project& project):project(project)
 {
-    audiodev=std::unique_ptr<IAudioDevice>(IAudioDevice::create());
+    // play back at the sample rate of the recording
+    IAudioDevice::Config config=IAudioDevice::Config::from_environment();
+    config.samplerate=get_track().get_samplerate();
+
+    audiostatistics=config.statistics;
+
+    // opening the device may take a while, which should not delay showing the project
+    audiodev=std::unique_ptr<IAudioDevice>(IAudioDevice::create_async(config));
 }
 
 
@@ -31,62 +37,79 @@ Controller::~Controller()
 
 void Controller::begin_move_chunk(Track::Chunk* chunk, double t, float y)
 {
+    Track& track=get_track();
+
     curchunk=chunk;
 
     Track::Chunk *first=chunk, *last=chunk;
     if (!chunk->elastic) {
-        while (first->prev && first->prev->elastic)
-            first=first->prev;
-        while (last->next && last->next->elastic)
-            last=last->next;
+        while (track.get_prev_chunk(first) && track.get_prev_chunk(first)->elastic)
+            first=track.get_prev_chunk(first);
+        while (track.get_next_chunk(last) && track.get_next_chunk(last)->elastic)
+            last=track.get_next_chunk(last);
     }
 
     curchunk=backup(first, last, chunk);
 
     moving_time_offset =chunk->begin - t;
 
-    audioprovider=create_render_audio_provider(get_track(), curchunk, curchunk->next->next);
-    audiodev->play(audioprovider);
+    stop_playback();
+
+    // the preview of a move which was never finished would otherwise keep sounding along with the new one
+    if (audioprovider)
+        audioprovider->terminate();
+
+    // mixed with the transport as it finishes, rather than cutting it off
+    audioprovider=get_render_cache().create_audio_provider(curchunk, track.get_next_chunk(track.get_next_chunk(curchunk)));
+    audiodev->add(audioprovider);
 }
 
 
 void Controller::do_move_chunk(double t, float y, bool move_pitch_contour, bool move_time)
 {
+    Track& track=get_track();
+    Track::Chunk* curbackup=track.get_chunk(curchunk->backup);
+
     if (!curchunk->elastic) {
         double firstt=undo_stack.top().first->begin;
         double lastt =undo_stack.top().last ->end;
 
         // FIXME: do some more sensible clamping here -- this is just sufficient to avoid chunk lengths to become negative and cause a crash subsequently
-        const double len=curchunk->backup->end - curchunk->backup->begin;
-        curchunk->begin=move_time ? std::clamp(moving_time_offset + t, firstt+1.0, lastt-len-1.0) : curchunk->backup->begin;
+        const double len=curbackup->end - curbackup->begin;
+        curchunk->begin=move_time ? std::clamp(moving_time_offset + t, firstt+1.0, lastt-len-1.0) : curbackup->begin;
         curchunk->end=curchunk->begin + len;
 
-        for (Track::Chunk *cur=curchunk->prev, *bup=curchunk->backup->prev; cur && bup && cur!=bup; cur=cur->prev, bup=bup->prev) {
-            cur->begin=lerp(firstt, curchunk->begin, unlerp(firstt, curchunk->backup->begin, bup->begin));
-            cur->end=cur->next->begin;
+        for (Track::Chunk *cur=track.get_prev_chunk(curchunk), *bup=track.get_prev_chunk(curbackup); cur && bup && cur!=bup; cur=track.get_prev_chunk(cur), bup=track.get_prev_chunk(bup)) {
+            cur->begin=lerp(firstt, curchunk->begin, unlerp(firstt, curbackup->begin, bup->begin));
+            cur->end=track.get_next_chunk(cur)->begin;
 
             for (int i=0;i<cur->pitchcontour.size();i++)
-                cur->pitchcontour[i].t=lerp(firstt, curchunk->begin, unlerp(firstt, curchunk->backup->begin, bup->pitchcontour[i].t));
+                cur->pitchcontour[i].t=lerp(firstt, curchunk->begin, unlerp(firstt, curbackup->begin, bup->pitchcontour[i].t));
         }
 
-        for (Track::Chunk *cur=curchunk->next, *bup=curchunk->backup->next; cur && bup && cur!=bup; cur=cur->next, bup=bup->next) {
-            cur->begin=cur->prev->end;
-            cur->end=lerp(curchunk->end, lastt, unlerp(curchunk->backup->end, lastt, bup->end));
+        for (Track::Chunk *cur=track.get_next_chunk(curchunk), *bup=track.get_next_chunk(curbackup); cur && bup && cur!=bup; cur=track.get_next_chunk(cur), bup=track.get_next_chunk(bup)) {
+            cur->begin=track.get_prev_chunk(cur)->end;
+            cur->end=lerp(curchunk->end, lastt, unlerp(curbackup->end, lastt, bup->end));
 
             for (int i=0;i<cur->pitchcontour.size();i++)
-                cur->pitchcontour[i].t=lerp(curchunk->end, lastt, unlerp(curchunk->backup->end, lastt, bup->pitchcontour[i].t));
+                cur->pitchcontour[i].t=lerp(curchunk->end, lastt, unlerp(curbackup->end, lastt, bup->pitchcontour[i].t));
         }
     }
 
     curchunk->pitch=lrintf(y);
 
     for (int i=0;i<curchunk->pitchcontour.size();i++)
-        curchunk->pitchcontour[i].y=curchunk->backup->pitchcontour[i].y + (move_pitch_contour ? curchunk->pitch-curchunk->backup->pitch : 0);
+        curchunk->pitchcontour[i].y=curbackup->pitchcontour[i].y + (move_pitch_contour ? curchunk->pitch-curbackup->pitch : 0);
 
     for (int i=0;i<curchunk->pitchcontour.size();i++) {
-        Track::PitchContourIterator pci(curchunk, i);
+        Track::PitchContourIterator pci(track, curchunk, i);
         Track::update_akima_slope(pci-2, pci-1, pci, pci+1, pci+2);
     }
+
+    // let the playback follow the drag, without touching the synth frames of the track until the move is finished
+    std::vector<Track::SynthFrame> frames;
+    auto [begin, end]=track.compute_synth_frames(frames, dirtyfirst, dirtylast);
+    rendercache->set_preview(begin, end, std::move(frames));
 }
 
 
@@ -97,13 +120,14 @@ void Controller::finish_move_chunk(double t, float y)
 
     curchunk=nullptr;
 
-    get_track().compute_synth_frames();
+    record_edit();
+    update_synth_frames();
 }
 
 
 void Controller::begin_move_edge(Track::Chunk* chunk, double t)
 {
-    curchunk=backup(chunk->prev, chunk, chunk);
+    curchunk=backup(get_track().get_prev_chunk(chunk), chunk, chunk);
 
     moving_time_offset =chunk->begin - t;
 }
@@ -111,16 +135,22 @@ void Controller::begin_move_edge(Track::Chunk* chunk, double t)
 
 void Controller::do_move_edge(double t)
 {
-    curchunk->prev->end=curchunk->begin=std::clamp(moving_time_offset+t, curchunk->prev->begin+1.0, curchunk->end-1.0);
+    Track& track=get_track();
+
+    Track::Chunk* curprev=track.get_prev_chunk(curchunk);
+    Track::Chunk* curbackup=track.get_chunk(curchunk->backup);
+    Track::Chunk* prevbackup=track.get_prev_chunk(curbackup);
+
+    curprev->end=curchunk->begin=std::clamp(moving_time_offset+t, curprev->begin+1.0, curchunk->end-1.0);
 
-    for (int i=0;i<curchunk->prev->pitchcontour.size();i++) {
-        curchunk->prev->pitchcontour[i].t=lerp(
-            curchunk->prev->begin,
-            curchunk->prev->end,
+    for (int i=0;i<curprev->pitchcontour.size();i++) {
+        curprev->pitchcontour[i].t=lerp(
+            curprev->begin,
+            curprev->end,
             unlerp(
-                curchunk->backup->prev->begin,
-                curchunk->backup->prev->end,
-                curchunk->backup->prev->pitchcontour[i].t
+                prevbackup->begin,
+                prevbackup->end,
+                prevbackup->pitchcontour[i].t
             )
         );
     }
@@ -130,9 +160,9 @@ void Controller::do_move_edge(double t)
             curchunk->begin,
             curchunk->end,
             unlerp(
-                curchunk->backup->begin,
-                curchunk->backup->end,
-                curchunk->backup->pitchcontour[i].t
+                curbackup->begin,
+                curbackup->end,
+                curbackup->pitchcontour[i].t
             )
         );
     }
@@ -143,12 +173,15 @@ void Controller::finish_move_edge(double t)
 {
     curchunk=nullptr;
 
-    get_track().compute_synth_frames();
+    record_edit();
+    update_synth_frames();
 }
 
 
 bool Controller::split_chunk(Track::Chunk* chunk, double t)
 {
+    Track& track=get_track();
+
     chunk=backup(chunk, chunk, chunk);
 
     double s=(t-chunk->begin) / (chunk->end-chunk->begin);
@@ -156,18 +189,22 @@ bool Controller::split_chunk(Track::Chunk* chunk, double t)
     if (atframe<=chunk->beginframe || atframe>=chunk->endframe)
         return false;
 
-    Track::Chunk* newchunk=new Track::Chunk(*chunk);
+    Track::Chunk* newchunk=track.chunks.allocate(*chunk);
 
     chunk->end=newchunk->begin=t;
     chunk->endframe=newchunk->beginframe=atframe;
 
-    chunk->next=newchunk;
-    newchunk->prev=chunk;
+    chunk->next=newchunk->slot;
+    newchunk->prev=chunk->slot;
+
+    dirtylast=newchunk;
 
-    if (newchunk->next)
-        newchunk->next->prev=newchunk;
+    if (newchunk->next>=0)
+        track.get_next_chunk(newchunk)->prev=newchunk->slot;
     else
-        get_track().lastchunk=newchunk;
+        track.lastchunk=newchunk->slot;
+
+    track.update_chunk_order();
 
     chunk->pitchcontour.erase(
         std::remove_if(
@@ -187,21 +224,26 @@ bool Controller::split_chunk(Track::Chunk* chunk, double t)
         newchunk->pitchcontour.end()
     );
 
+    record_edit();
+    update_synth_frames();
+
     return true;
 }
 
 
 bool Controller::merge_chunks(Track::Chunk* chunk)
 {
-    chunk=backup(chunk->prev, chunk, chunk);
+    Track& track=get_track();
+
+    chunk=backup(track.get_prev_chunk(chunk), chunk, chunk);
 
     Track::Chunk* removed=chunk;
-    chunk=chunk->prev;
+    chunk=track.get_prev_chunk(chunk);
 
-    if (removed->next)
-        removed->next->prev=chunk;
+    if (removed->next>=0)
+        track.get_next_chunk(removed)->prev=chunk->slot;
     else
-        get_track().lastchunk=chunk;
+        track.lastchunk=chunk->slot;
     
     chunk->next=removed->next;
     chunk->end=removed->end;
@@ -210,7 +252,14 @@ bool Controller::merge_chunks(Track::Chunk* chunk)
     for (auto& pc: removed->pitchcontour)
         chunk->pitchcontour.push_back(pc);
     
-    delete removed;
+    track.chunks.release(removed);
+
+    dirtylast=chunk;
+
+    track.update_chunk_order();
+
+    record_edit();
+    update_synth_frames();
 
     return true;
 }
@@ -218,7 +267,7 @@ bool Controller::merge_chunks(Track::Chunk* chunk)
 
 void Controller::begin_move_pitch_contour_control_point(Track::PitchContourIterator cp, double t, float y)
 {
-    curpci=Track::PitchContourIterator(backup(cp.get_chunk(), cp.get_chunk(), cp.get_chunk()), cp.get_index());
+    curpci=Track::PitchContourIterator(get_track(), backup(cp.get_chunk(), cp.get_chunk(), cp.get_chunk()), cp.get_index());
 }
 
 
@@ -239,7 +288,8 @@ void Controller::do_move_pitch_contour_control_point(double t, float y)
 
 void Controller::finish_move_pitch_contour_control_point(double t, float y)
 {
-    get_track().compute_synth_frames();
+    record_edit();
+    update_synth_frames();
 }
 
 
@@ -251,7 +301,8 @@ bool Controller::insert_pitch_contour_control_point(Track::PitchContourIterator
 
     Track::update_akima_slope(after-1, after, after+1, after+2, after+3);
 
-    get_track().compute_synth_frames();
+    record_edit(after.get_chunk(), after.get_chunk(), 1);
+    update_synth_frames(after.get_chunk(), after.get_chunk());
 
     return true;
 }
@@ -262,7 +313,8 @@ bool Controller::delete_pitch_contour_control_point(Track::PitchContourIterator
     if (cp-1 && cp+1) {
         cp.get_chunk()->pitchcontour.erase(cp.get_chunk()->pitchcontour.begin() + cp.get_index());
 
-        get_track().compute_synth_frames();
+        record_edit(cp.get_chunk(), cp.get_chunk(), 1);
+        update_synth_frames(cp.get_chunk(), cp.get_chunk());
         return true;
     }
     else
@@ -276,35 +328,42 @@ bool Controller::set_elastic(Track::Chunk* chunk, bool elastic)
 
     chunk->elastic=elastic;
 
+    record_edit();
+    update_synth_frames();
+
     return true;
 }
 
 
 Track::Chunk* Controller::backup(Track::Chunk* first, Track::Chunk* last, Track::Chunk* mid)
 {
+    Track& track=get_track();
+
     undo_stack.push({ first, last });
 
     Track::Chunk* midcopy=nullptr;
 
-    Track::Chunk* firstcopy=new Track::Chunk(*first);
-    firstcopy->backup=first;
+    Track::Chunk* firstcopy=track.chunks.allocate(*first);
+    firstcopy->backup=first->slot;
+
+    dirtyfirst=firstcopy;
 
-    if (firstcopy->prev)
-        firstcopy->prev->next=firstcopy;
+    if (firstcopy->prev>=0)
+        track.get_prev_chunk(firstcopy)->next=firstcopy->slot;
     else
-        get_track().firstchunk=firstcopy;
+        track.firstchunk=firstcopy->slot;
 
     if (first==mid)
         midcopy=firstcopy;
     
     while (first!=last) {
-        first=first->next;
+        first=track.get_next_chunk(first);
 
-        Track::Chunk* copy=new Track::Chunk(*first);
-        copy->backup=first;
+        Track::Chunk* copy=track.chunks.allocate(*first);
+        copy->backup=first->slot;
 
-        firstcopy->next=copy;
-        copy->prev=firstcopy;
+        firstcopy->next=copy->slot;
+        copy->prev=firstcopy->slot;
 
         firstcopy=copy;
 
@@ -312,32 +371,193 @@ Track::Chunk* Controller::backup(Track::Chunk* first, Track::Chunk* last, Track:
             midcopy=firstcopy;
     }
 
-    if (firstcopy->next)
-        firstcopy->next->prev=firstcopy;
+    if (firstcopy->next>=0)
+        track.get_next_chunk(firstcopy)->prev=firstcopy->slot;
     else
-        get_track().lastchunk=firstcopy;
+        track.lastchunk=firstcopy->slot;
+
+    track.update_chunk_order();
+
+    dirtylast=firstcopy;
 
     return midcopy;
 }
 
 
+void Controller::record_edit(Track::Chunk* first, Track::Chunk* last, int count)
+{
+    Track& track=get_track();
+
+    /* Moving a control point updates the slopes of its neighbours, which may belong to the adjacent chunks of the
+     * same voiced run, without backing these up, so the record extends to the whole run. */
+    if (first->voiced)
+        for (Track::Chunk* prev=track.get_prev_chunk(first); prev && prev->voiced; prev=track.get_prev_chunk(first)) {
+            first=prev;
+            count++;
+        }
+
+    if (last->voiced)
+        for (Track::Chunk* next=track.get_next_chunk(last); next && next->voiced; next=track.get_next_chunk(last)) {
+            last=next;
+            count++;
+        }
+
+    project.record_edit(0, track.make_edit(first, last, count));
+}
+
+
+void Controller::record_edit()
+{
+    const BackupState& bs=undo_stack.top();
+
+    int count=1;
+    for (Track::Chunk* chunk=bs.first; chunk!=bs.last; chunk=get_track().get_next_chunk(chunk))
+        count++;
+
+    record_edit(dirtyfirst, dirtylast, count);
+}
+
+
+void Controller::update_synth_frames()
+{
+    update_synth_frames(dirtyfirst, dirtylast);
+
+    dirtyfirst=dirtylast=nullptr;
+}
+
+
+void Controller::update_synth_frames(Track::Chunk* first, Track::Chunk* last)
+{
+    auto [begin, end]=get_track().compute_synth_frames(first, last);
+
+    // without a cache, the track has not been played yet, and edits are picked up once its frames are computed
+    if (rendercache)
+        rendercache->invalidate(begin, end);
+}
+
+
+void Controller::compute_synth_frames()
+{
+    if (!get_track().has_synth_frames())
+        get_track().compute_synth_frames();
+}
+
+
+IRenderCache& Controller::get_render_cache()
+{
+    /* Rendering the whole track ahead reads and decodes all of its sample data, so this is put off until the track
+     * is actually played, rather than done as soon as it is shown. */
+    if (!rendercache) {
+        compute_synth_frames();
+        rendercache=std::unique_ptr<IRenderCache>(IRenderCache::create(get_track()));
+    }
+
+    return *rendercache;
+}
+
+
+void Controller::start_playback(double t)
+{
+    // a new transport picks up the current version of the synth frames
+    stop_playback();
+
+    transport=get_render_cache().create_transport();
+    transport->set_loop(loopbegin, loopend);
+    transport->seek(lrint(t));
+
+    if (audiostatistics)
+        audiodev->reset_statistics();
+
+    audiodev->play(transport);
+}
+
+
+void Controller::stop_playback()
+{
+    if (!transport) return;
+
+    transport->terminate();
+    transport=nullptr;
+
+    if (audiostatistics)
+        report_audio_statistics();
+}
+
+
+void Controller::report_audio_statistics()
+{
+    const IAudioDevice::Statistics stats=audiodev->get_statistics();
+
+    fprintf(stderr, "Audio: %lu callbacks, %lu underflows, callback time %.3f ms mean, %.3f ms max, load %.0f%% max, CPU load %.0f%%, latency %.1f ms\n",
+        stats.callbacks,
+        stats.underflows,
+        stats.meancallbacktime*1e3,
+        stats.maxcallbacktime*1e3,
+        stats.maxload*100,
+        stats.cpuload*100,
+        stats.latency*1e3);
+}
+
+
+void Controller::set_playback_loop(double begin, double end)
+{
+    loopbegin=lrint(begin);
+    loopend  =lrint(end);
+
+    if (transport)
+        transport->set_loop(loopbegin, loopend);
+}
+
+
+void Controller::scrub(double t)
+{
+    if (!transport) {
+        transport=get_render_cache().create_transport();
+        transport->set_loop(loopbegin, loopend);
+
+        if (audiostatistics)
+            audiodev->reset_statistics();
+
+        audiodev->play(transport);
+    }
+
+    transport->scrub(lrint(t));
+}
+
+
 void Controller::undo()
 {
     if (undo_stack.empty()) return;
 
+    Track& track=get_track();
+
     BackupState& bs=undo_stack.top();
 
-    if (bs.first->prev)
-        bs.first->prev->next=bs.first;
+    // the chunks which are about to be replaced by their backups
+    Track::Chunk* curfirst=bs.first->prev>=0 ? track.get_next_chunk(track.get_prev_chunk(bs.first)) : track.get_first_chunk();
+    Track::Chunk* curlast =bs.last ->next>=0 ? track.get_prev_chunk(track.get_next_chunk(bs.last )) : track.get_last_chunk();
+
+    int count=1;
+    for (Track::Chunk* chunk=curfirst; chunk!=curlast; chunk=track.get_next_chunk(chunk))
+        count++;
+
+    if (bs.first->prev>=0)
+        track.get_prev_chunk(bs.first)->next=bs.first->slot;
     else
-        get_track().firstchunk=bs.first;
+        track.firstchunk=bs.first->slot;
     
-    if (bs.last->next)
-        bs.last->next->prev=bs.last;
+    if (bs.last->next>=0)
+        track.get_next_chunk(bs.last)->prev=bs.last->slot;
     else
-        get_track().lastchunk=bs.last;
+        track.lastchunk=bs.last->slot;
+
+    Track::Chunk* first=bs.first;
+    Track::Chunk* last =bs.last;
 
     undo_stack.pop();
 
-    get_track().compute_synth_frames();
+    track.update_chunk_order();
+
+    record_edit(first, last, count);
+    update_synth_frames(first, last);
 }
@@ -3,6 +3,7 @@
 #include <stack>
 #include "project.h"
 #include "audio.h"
+#include "render.h"
 
 
 class Controller {
@@ -20,6 +21,11 @@ public:
         return *audiodev;
     }
 
+    bool is_playing() const
+    {
+        return transport!=nullptr;
+    }
+
 
     void begin_move_chunk(Track::Chunk*, double t, float y);
     void do_move_chunk(double t, float y, bool move_pitch_contour, bool move_time);
@@ -41,15 +47,45 @@ public:
 
     bool set_elastic(Track::Chunk*, bool);
 
+    // playback of the output at arbitrary positions, which are given in samples; the loop applies to all further
+    // playback until it is cleared by setting end<=begin
+    void start_playback(double t);
+    void stop_playback();
+    void set_playback_loop(double begin, double end);
+    void scrub(double t);
+
     void undo();
 
+    // synth frames are only computed once needed, i.e. on first playback or before exporting
+    void compute_synth_frames();
+
 private:
     Track::Chunk* backup(Track::Chunk* first, Track::Chunk* last, Track::Chunk* mid=nullptr);
 
+    // records the replacement of count chunks by the run from first to last in the journal of the project
+    void record_edit(Track::Chunk* first, Track::Chunk* last, int count);
+    // records the replacement of the chunks last backed up by their modified copies
+    void record_edit();
+
+    void update_synth_frames();
+    void update_synth_frames(Track::Chunk* first, Track::Chunk* last);
+
+    // creates the render cache on first use, along with the synth frames of the track
+    IRenderCache& get_render_cache();
+
+    // prints the statistics of the audio device since playback started, for tuning its buffer size and latency
+    void report_audio_statistics();
+
     Project&                        project;
 
+    std::unique_ptr<IRenderCache>   rendercache;
     std::unique_ptr<IAudioDevice>   audiodev;
     std::shared_ptr<IAudioProvider> audioprovider;
+    std::shared_ptr<ITransport>     transport;
+    bool                            audiostatistics=false;
+
+    long                            loopbegin=0;
+    long                            loopend  =0;
 
     Track::Chunk*                   curchunk=nullptr;
     Track::PitchContourIterator     curpci=nullptr;
@@ -57,6 +93,10 @@ private:
     // state while moving chunk
     double                          moving_time_offset=0.0;
 
+    // range of chunks modified by the current edit, whose synth frames need to be recomputed
+    Track::Chunk*                   dirtyfirst=nullptr;
+    Track::Chunk*                   dirtylast =nullptr;
+
     struct BackupState {
         Track::Chunk*   first;
         Track::Chunk*   last;
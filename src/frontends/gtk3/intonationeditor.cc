@@ -1,3 +1,4 @@
+#include <vector>
 #include "intonationeditor.h"
 #include "controller.h"
 
@@ -50,6 +51,65 @@ IntonationEditor::IntonationEditor(BaseObjectType* obj, const Glib::RefPtr<Gtk::
 }
 
 
+bool IntonationEditor::on_key_press_event(GdkEventKey* event)
+{
+    switch (event->keyval) {
+    case GDK_KEY_space:
+        // play from the left edge of the visible part of the track
+        if (controller.is_playing())
+            controller.stop_playback();
+        else
+            controller.start_playback(hadjustment ? hadjustment->get_value() : 0.0);
+        return true;
+    case GDK_KEY_l:
+        // loop the visible part of the track
+        looping=!looping;
+        if (looping && hadjustment)
+            controller.set_playback_loop(hadjustment->get_value(), hadjustment->get_value()+hadjustment->get_page_size());
+        else
+            controller.set_playback_loop(0.0, 0.0);
+        return true;
+    }
+
+    return Canvas::on_key_press_event(event);
+}
+
+
+/******** Background Layer ********/
+
+std::any IntonationEditor::BackgroundLayer::get_focused_item(double x, double y)
+{
+    return true;
+}
+
+
+bool IntonationEditor::BackgroundLayer::is_focused_item(const std::any& item, double x, double y)
+{
+    return true;
+}
+
+
+void IntonationEditor::BackgroundLayer::on_motion_notify_event(const std::any& item, GdkEventMotion* event)
+{
+    if (event->state & Gdk::BUTTON1_MASK)
+        ie.controller.scrub(event->x/ie.hscale);
+}
+
+
+void IntonationEditor::BackgroundLayer::on_button_press_event(const std::any& item, GdkEventButton* event)
+{
+    if (event->button==1)
+        ie.controller.scrub(event->x/ie.hscale);
+}
+
+
+void IntonationEditor::BackgroundLayer::on_button_release_event(const std::any& item, GdkEventButton* event)
+{
+    if (event->button==1)
+        ie.controller.stop_playback();
+}
+
+
 void IntonationEditor::BackgroundLayer::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
 {
     const double width=ie.track.get_waveform().get_length();
@@ -99,9 +159,9 @@ void IntonationEditor::BackgroundLayer::on_draw(const Cairo::RefPtr<Cairo::Conte
 
 std::any IntonationEditor::ChunksLayer::get_focused_item(double x, double y)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next)
-        if (x>=chunk->begin*ie.hscale && x<chunk->end*ie.hscale && y>=(119-chunk->pitch)*ie.vscale && y<=(120-chunk->pitch)*ie.vscale)
-            return chunk;
+    Track::Chunk* chunk=ie.track.find_chunk(x/ie.hscale);
+    if (chunk && y>=(119-chunk->pitch)*ie.vscale && y<=(120-chunk->pitch)*ie.vscale)
+        return chunk;
 
     return {};
 }
@@ -116,7 +176,7 @@ bool IntonationEditor::ChunksLayer::is_focused_item(const std::any& item, double
 
 void IntonationEditor::ChunksLayer::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next) {
+    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=ie.track.get_next_chunk(chunk)) {
         double r, g, b;
 
         if (chunk->voiced)
@@ -229,17 +289,20 @@ Cairo::RefPtr<Cairo::ImageSurface> IntonationEditor::ChunksLayer::create_chunk_t
     unsigned char* data=img->get_data();
 
     const auto& wave=ie.track.get_waveform();
+    const auto samples=wave.get_samples();
 
     const double t0=wave.get_frame(chunk->beginframe).position;
     const double t1=wave.get_frame(chunk->  endframe).position;
 
+    wave.fetch(lrint(t0), lrint(t1)+1);
+
     for (int x=0;x<width;x++) {
         int begin=lrint(t0 + (t1-t0)*x/width);
         int end  =lrint(t0 + (t1-t0)*(x+1)/width);
 
         float sum=0.0;
         for (int i=begin;i<end;i++)
-            sum+=sqr(wave[i]);
+            sum+=sqr(samples[i]);
 
         sum/=end-begin;
         sum*=1e+7f;
@@ -267,8 +330,10 @@ Cairo::RefPtr<Cairo::ImageSurface> IntonationEditor::ChunksLayer::create_chunk_t
 
 std::any IntonationEditor::ChunkEdgesLayer::get_focused_item(double x, double y)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk()->next; chunk; chunk=chunk->next) {
-        if (chunk->elastic && chunk->prev->elastic && fabs(chunk->begin*ie.hscale - x) < 2.5 && y > (118.5-std::max(chunk->pitch, chunk->prev->pitch))*ie.vscale && y < (120.5-std::min(chunk->pitch, chunk->prev->pitch))*ie.vscale)
+    for (Track::Chunk* chunk=ie.track.get_next_chunk(ie.track.get_first_chunk()); chunk; chunk=ie.track.get_next_chunk(chunk)) {
+        const Track::Chunk* prev=ie.track.get_prev_chunk(chunk);
+
+        if (chunk->elastic && prev->elastic && fabs(chunk->begin*ie.hscale - x) < 2.5 && y > (118.5-std::max(chunk->pitch, prev->pitch))*ie.vscale && y < (120.5-std::min(chunk->pitch, prev->pitch))*ie.vscale)
             return chunk;
     }
 
@@ -279,8 +344,11 @@ std::any IntonationEditor::ChunkEdgesLayer::get_focused_item(double x, double y)
 bool IntonationEditor::ChunkEdgesLayer::is_focused_item(const std::any& item, double x, double y)
 {
     Track::Chunk* chunk=std::any_cast<Track::Chunk*>(item);
+    if (!chunk) return false;
+
+    const Track::Chunk* prev=ie.track.get_prev_chunk(chunk);
 
-    return chunk && fabs(chunk->begin*ie.hscale - x) < 2.5 && y > (118.5-std::max(chunk->pitch, chunk->prev->pitch))*ie.vscale && y < (120.5-std::min(chunk->pitch, chunk->prev->pitch))*ie.vscale;
+    return fabs(chunk->begin*ie.hscale - x) < 2.5 && y > (118.5-std::max(chunk->pitch, prev->pitch))*ie.vscale && y < (120.5-std::min(chunk->pitch, prev->pitch))*ie.vscale;
 }
 
 
@@ -305,8 +373,10 @@ void IntonationEditor::ChunkEdgesLayer::on_button_press_event(const std::any& it
         // show context menu
         auto menu=Gtk::make_managed<Gtk::Menu>();
 
+        const Track::Chunk* prev=ie.track.get_prev_chunk(chunk);
+
         auto menuitem_merge=Gtk::make_managed<Gtk::MenuItem>("Merge");
-        menuitem_merge->set_sensitive(chunk->prev->voiced==chunk->voiced && chunk->prev->elastic==chunk->elastic && chunk->prev->pitch==chunk->pitch);
+        menuitem_merge->set_sensitive(prev->voiced==chunk->voiced && prev->elastic==chunk->elastic && prev->pitch==chunk->pitch);
         menuitem_merge->signal_activate().connect(sigc::bind(sigc::mem_fun(*this, &ChunkEdgesLayer::on_merge_chunks), chunk));
         menu->append(*menuitem_merge);
 
@@ -329,12 +399,14 @@ void IntonationEditor::ChunkEdgesLayer::on_draw(const Cairo::RefPtr<Cairo::Conte
     cr->set_source_rgb(1.0, 1.0, 1.0);
     cr->set_line_width(2.0);
 
-    for (Track::Chunk* chunk=ie.track.get_first_chunk()->next; chunk; chunk=chunk->next) {
+    for (Track::Chunk* chunk=ie.track.get_next_chunk(ie.track.get_first_chunk()); chunk; chunk=ie.track.get_next_chunk(chunk)) {
         if (!has_focus(chunk)) continue;
 
+        const Track::Chunk* prev=ie.track.get_prev_chunk(chunk);
+
         double x=round(chunk->begin*ie.hscale);
-        cr->move_to(x, (118.5-std::max(chunk->pitch, chunk->prev->pitch))*ie.vscale);
-        cr->line_to(x, (120.5-std::min(chunk->pitch, chunk->prev->pitch))*ie.vscale);
+        cr->move_to(x, (118.5-std::max(chunk->pitch, prev->pitch))*ie.vscale);
+        cr->line_to(x, (120.5-std::min(chunk->pitch, prev->pitch))*ie.vscale);
     }
 
     cr->stroke();
@@ -351,18 +423,17 @@ void IntonationEditor::ChunkEdgesLayer::on_merge_chunks(Track::Chunk* chunk)
 
 std::any IntonationEditor::PitchContoursLayer::get_focused_item(double x, double y)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next) {
+    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=ie.track.get_next_chunk(chunk)) {
         if (!chunk->voiced) continue;
 
         for (int i=0;i<chunk->pitchcontour.size();i++) {
-            Track::PitchContourIterator pci1(chunk, i);
+            Track::PitchContourIterator pci1(ie.track, chunk, i);
 
             if (x<=pci1->t*ie.hscale) {
                 auto pci0=pci1-1;
                 if (!pci0 || x<pci0->t*ie.hscale) return {};
 
-                Track::HermiteInterpolation hi(*pci0, *pci1);
-                if (fabs((119.5 - hi(x/ie.hscale))*ie.vscale - y) < 2.5f)
+                if (is_focused_item(pci0, x, y))
                     return pci0;
 
                 return {};
@@ -376,11 +447,9 @@ std::any IntonationEditor::PitchContoursLayer::get_focused_item(double x, double
 
 bool IntonationEditor::PitchContoursLayer::is_focused_item(const std::any& item, double x, double y)
 {
-    auto pci0=std::any_cast<Track::PitchContourIterator>(item);
-    auto pci1=pci0 + 1;
+    const Track::PitchContourSpline contour(std::any_cast<Track::PitchContourIterator>(item));
 
-    Track::HermiteInterpolation hi(*pci0, *pci1);
-    return fabs((119.5 - hi(x/ie.hscale))*ie.vscale - y) < 2.5f;
+    return fabs((119.5 - contour(x/ie.hscale))*ie.vscale - y) < 2.5f;
 }
 
 
@@ -398,36 +467,43 @@ void IntonationEditor::PitchContoursLayer::on_draw(const Cairo::RefPtr<Cairo::Co
     cr->set_source_rgb(0.25, 0.25, 1.0);
     cr->set_line_width(3.0);
 
-    Track::HermiteSplinePoint* lastpt=nullptr;
+    double left, top, right, bottom;
+    cr->get_clip_extents(left, top, right, bottom);
 
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next) {
-        if (!chunk->voiced) {
-            lastpt=nullptr;
-            continue;
-        }
+    // the contour of each run of voiced chunks is sampled every few pixels within the area drawn
+    constexpr double step=2.0;
 
-        for (int i=0;i<chunk->pitchcontour.size();i++) {
-            Track::HermiteSplinePoint* curpt=&chunk->pitchcontour[i];
+    std::vector<double> times;
+    std::vector<float>  pitches;
 
-            if (!lastpt)
-                cr->move_to(curpt->t*ie.hscale, (119.5-curpt->y)*ie.vscale);
-            else {
-                const double t0=lastpt->t;
-                const double t1= curpt->t;
-                const double dt= curpt->t - lastpt->t;
-
-                cr->curve_to(
-                    (t0 + dt/3) * ie.hscale,
-                    (119.5 - lastpt->y - lastpt->dy*dt/3)*ie.vscale,
-                    (t1 - dt/3) * ie.hscale,
-                    (119.5 -  curpt->y +  curpt->dy*dt/3)*ie.vscale,
-                    t1 * ie.hscale,
-                    (119.5 -  curpt->y)*ie.vscale
-                );
-            }
+    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=ie.track.get_next_chunk(chunk)) {
+        if (!chunk->voiced) continue;
+        if (chunk->begin*ie.hscale>right) break;
 
-            lastpt=curpt;
-        }
+        Track::Chunk* first=chunk;
+        while (ie.track.get_next_chunk(chunk) && ie.track.get_next_chunk(chunk)->voiced)
+            chunk=ie.track.get_next_chunk(chunk);
+
+        if (chunk->end*ie.hscale<left) continue;
+
+        const Track::PitchContourSpline contour(Track::PitchContourIterator(ie.track, first, 0));
+
+        const double begin=std::max(contour.get_begin(), left /ie.hscale);
+        const double end  =std::min(contour.get_end(),   right/ie.hscale);
+        if (begin>end) continue;
+
+        times.clear();
+        for (double x=begin*ie.hscale; x<end*ie.hscale; x+=step)
+            times.push_back(x/ie.hscale);
+        times.push_back(end);
+
+        pitches.resize(times.size());
+        contour.evaluate(pitches.data(), times.data(), int(times.size()));
+
+        cr->move_to(times[0]*ie.hscale, (119.5-pitches[0])*ie.vscale);
+
+        for (size_t i=1;i<times.size();i++)
+            cr->line_to(times[i]*ie.hscale, (119.5-pitches[i])*ie.vscale);
     }
 
     cr->stroke();
@@ -438,12 +514,12 @@ void IntonationEditor::PitchContoursLayer::on_draw(const Cairo::RefPtr<Cairo::Co
 
 std::any IntonationEditor::PitchControlPointsLayer::get_focused_item(double x, double y)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next) {
+    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=ie.track.get_next_chunk(chunk)) {
         if (!chunk->voiced) continue;
 
         for (int i=0;i<chunk->pitchcontour.size();i++) {
             if (sqr(chunk->pitchcontour[i].t*ie.hscale-x)+sqr((119.5-chunk->pitchcontour[i].y)*ie.vscale-y) < 16.0)
-                return Track::PitchContourIterator(chunk, i);
+                return Track::PitchContourIterator(ie.track, chunk, i);
         }
     }
 
@@ -489,13 +565,13 @@ void IntonationEditor::PitchControlPointsLayer::on_key_press_event(const std::an
 
 void IntonationEditor::PitchControlPointsLayer::on_draw(const Cairo::RefPtr<Cairo::Context>& cr)
 {
-    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=chunk->next) {
+    for (Track::Chunk* chunk=ie.track.get_first_chunk(); chunk; chunk=ie.track.get_next_chunk(chunk)) {
         if (!chunk->voiced) continue;
 
         for (int i=0;i<chunk->pitchcontour.size();i++) {
             double r;
 
-            if (has_focus(Track::PitchContourIterator(chunk, i))) {
+            if (has_focus(Track::PitchContourIterator(ie.track, chunk, i))) {
                 cr->set_source_rgb(0.5, 0.75, 1.0);
                 r=5.0;
             }
@@ -17,6 +17,14 @@ protected:
     public:
         BackgroundLayer(IntonationEditor& ie):CanvasLayer(ie), ie(ie) {}
 
+        // the background takes the pointer wherever no item does, and scrubs the output while dragged
+        virtual std::any get_focused_item(double x, double y) override;
+        virtual bool is_focused_item(const std::any&, double x, double y) override;
+
+        virtual void on_motion_notify_event(const std::any&, GdkEventMotion* event) override;
+        virtual void on_button_press_event(const std::any&, GdkEventButton* event) override;
+        virtual void on_button_release_event(const std::any&, GdkEventButton* event) override;
+
     protected:
         virtual void on_draw(const Cairo::RefPtr<Cairo::Context>&);
     };
@@ -97,6 +105,9 @@ protected:
         virtual void on_draw(const Cairo::RefPtr<Cairo::Context>&);
     };
 
+    // playback keys apply wherever the pointer is, all other keys go to the focused item
+    bool on_key_press_event(GdkEventKey* event) override;
+
 private:
     Controller&             controller;
     Track&                  track;
@@ -107,6 +118,8 @@ private:
     PitchContoursLayer      pitchcontourslayer;
     PitchControlPointsLayer pitchcontrolpointslayer;
 
+    bool                    looping=false;
+
     Glib::RefPtr<Gtk::Adjustment>   bpm;
     Glib::RefPtr<Gtk::Adjustment>   beat_subdivisions;
 };
@@ -1,5 +1,4 @@
 #include <memory>
-#include <fstream>
 #include "project.h"
 #include "controller.h"
 #include "audio.h"
@@ -20,7 +19,7 @@ private:
     void on_load_wave();
     void on_about();
 
-    void open_main_window_for_project(std::unique_ptr<Project>&&);
+    void open_main_window_for_project(std::unique_ptr<Project>&&, const std::string& filename=std::string());
 
     Gtk::ApplicationWindow* welcomedlg=nullptr;
 };
@@ -74,10 +73,18 @@ void App::on_load_project()
         auto project=std::make_unique<Project>();
 
         try {
-            std::ifstream ifs(dlg.get_filename(), std::ios::binary);
-            project->read(ifs);
+            project->read(dlg.get_filename().c_str());
 
-            open_main_window_for_project(std::move(project));
+            if (project->has_unsaved_edits()) {
+                Gtk::MessageDialog recoverdlg(dlg, "The project has unsaved changes from a session which did not end properly. Do you want to recover them?", false, Gtk::MESSAGE_QUESTION, Gtk::BUTTONS_YES_NO);
+
+                if (recoverdlg.run()==Gtk::RESPONSE_YES)
+                    project->recover_unsaved_edits();
+                else
+                    project->discard_unsaved_edits(dlg.get_filename().c_str());
+            }
+
+            open_main_window_for_project(std::move(project), dlg.get_filename());
         }
         catch (std::exception& e) {
             Gtk::MessageDialog errdlg(dlg, e.what(), false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_CLOSE);
@@ -123,7 +130,6 @@ void App::on_load_wave()
                 auto track=std::make_unique<Track>(std::move(waveform));
                 track->detect_chunks();
                 track->compute_pitch_contour();
-                track->compute_synth_frames();
 
                 project->tracks.push_back(std::move(track));
             }
@@ -166,12 +172,12 @@ void App::on_about()
 }
 
 
-void App::open_main_window_for_project(std::unique_ptr<Project>&& project)
+void App::open_main_window_for_project(std::unique_ptr<Project>&& project, const std::string& filename)
 {
     auto builder=Gtk::Builder::create_from_resource("/opt/meow/mainwindow.ui");
     
     MainWindow* wnd;
-    builder->get_widget_derived("mainwnd", wnd, std::move(project));
+    builder->get_widget_derived("mainwnd", wnd, std::move(project), filename);
 
     wnd->show_all();
 
@@ -1,12 +1,12 @@
-#include <fstream>
 #include "controller.h"
 #include "mainwindow.h"
 #include "asyncoperationwindow.h"
 
 
-MainWindow::MainWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, std::unique_ptr<Project>&& in_project):
+MainWindow::MainWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, std::unique_ptr<Project>&& in_project, const std::string& filename):
     Gtk::ApplicationWindow(obj),
-    project(std::move(in_project))
+    project(std::move(in_project)),
+    filename(filename)
     
 {
     add_action("undo", sigc::mem_fun(*this, &MainWindow::on_undo));
@@ -42,6 +42,37 @@ MainWindow::MainWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& bu
 
     bpm              ->signal_value_changed().connect(sigc::mem_fun(*this, &MainWindow::on_bpm_changed));
     beat_subdivisions->signal_value_changed().connect(sigc::mem_fun(*this, &MainWindow::on_bpm_changed));
+
+    dispatch_saved.connect(sigc::mem_fun(*this, &MainWindow::on_saved));
+
+    Glib::signal_timeout().connect_seconds(sigc::mem_fun(*this, &MainWindow::on_autosave), autosave_interval);
+}
+
+
+MainWindow::~MainWindow()
+{
+    // a save still going on or requested may contain the last edits saved, which are not to be discarded below
+    if (saving) {
+        savethread.join();
+        saving=false;
+
+        if (!saveexception)
+            commit_save();
+
+        pendingsnapshot.reset();
+        pendingupdate.reset();
+    }
+
+    if (queuedsave) {
+        save(*queuedsave, false);
+        savethread.join();
+
+        if (!saveexception)
+            commit_save();
+    }
+
+    if (!filename.empty())
+        project->discard_unsaved_edits(filename.c_str());
 }
 
 
@@ -81,12 +112,120 @@ void MainWindow::on_save_project()
         if (filename.find('.')==std::string::npos)
             filename.append(".meow");
 
-        std::ofstream ofs(filename, std::ios::binary);
-        project->write(ofs);
+        save(filename, false);
+    }
+}
+
+
+// records the edits in the journal of the project file, if there is one yet, so that they can be recovered after a crash
+bool MainWindow::on_autosave()
+{
+    if (!filename.empty() && !saving && project->has_journal() && project->has_pending_edits())
+        save(filename, true);
+
+    return true;
+}
+
+
+void MainWindow::save(const std::string& target, bool autosave)
+{
+    // waiting for the save going on would block the user interface, so another one is started once it has finished
+    if (saving) {
+        if (!autosave)
+            queuedsave=target;
+
+        return;
+    }
+
+    saving=true;
+    autosaving=autosave;
+    savefilename=target;
+    saveexception=nullptr;
+
+    // the thread has the pending snapshot or update to itself until it is joined
+    if (target==filename && project->has_journal() && (autosave || !project->journal_needs_compaction()))
+        pendingupdate=project->take_journal_update(!autosave);
+    else
+        pendingsnapshot=project->take_snapshot();
+
+    savethread=std::thread([this]() {
+        try {
+            if (pendingupdate)
+                pendingupdate->append(savefilename.c_str());
+            else
+                pendingsnapshot->write(savefilename.c_str());
+        }
+        catch (...) {
+            saveexception=std::current_exception();
+        }
+
+        dispatch_saved();
+    });
+}
+
+
+void MainWindow::on_saved()
+{
+    finish_save();
+
+    if (queuedsave) {
+        const std::string target=*queuedsave;
+        queuedsave.reset();
+
+        save(target, false);
     }
 }
 
 
+void MainWindow::finish_save()
+{
+    savethread.join();
+    saving=false;
+
+    std::string error;
+
+    try {
+        if (saveexception)
+            std::rethrow_exception(saveexception);
+
+        commit_save();
+    }
+    catch (std::exception& e) {
+        error=e.what();
+    }
+
+    pendingsnapshot.reset();
+    pendingupdate.reset();
+
+    // autosaving keeps failing for the same reason, so a failure is only reported until the next success
+    const bool report=!error.empty() && !(autosaving && autosavefailed);
+
+    if (autosaving)
+        autosavefailed=!error.empty();
+
+    if (report) {
+        Gtk::MessageDialog errdlg(*this, autosaving ? "Autosave failed: " + error : error, false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_CLOSE);
+        errdlg.run();
+    }
+}
+
+
+void MainWindow::commit_save()
+{
+    if (pendingupdate) {
+        project->commit(*pendingupdate);
+        return;
+    }
+
+    // edits journaled for the previous file but not saved are part of the new one now
+    if (!filename.empty() && filename!=savefilename)
+        project->discard_unsaved_edits(filename.c_str());
+
+    project->commit(*pendingsnapshot);
+    filename=savefilename;
+}
+
+
 void MainWindow::on_export_track()
 {
     Gtk::FileChooserDialog dlg(*this, "Save Project", Gtk::FILE_CHOOSER_ACTION_SAVE);
@@ -95,37 +234,69 @@ void MainWindow::on_export_track()
     dlg.add_button(Gtk::StockID("gtk-cancel"), Gtk::RESPONSE_CANCEL);
 
     auto filter_proj=Gtk::FileFilter::create();
-    filter_proj->set_name("Wave Files");
+    filter_proj->set_name("Audio Files");
     filter_proj->add_mime_type("audio/wav");
+    filter_proj->add_mime_type("audio/flac");
     dlg.add_filter(filter_proj);
 
+    dlg.add_choice(
+        "format",
+        "Format",
+        { "wave16", "wave24", "wavefloat", "flac", "raw" },
+        { "WAV 16-bit", "WAV 24-bit", "WAV 32-bit float", "FLAC 24-bit", "Raw 32-bit float" });
+    dlg.set_choice("format", "wave16");
+
     if (dlg.run()==Gtk::RESPONSE_OK) {
         class ExportTrackOperationWindow:public AsyncOperationWindow {
             std::string                 filename;
             const Track&                track;
+            Track::ExportFormat         format;
 
         public:
-            ExportTrackOperationWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, const std::string& filename, const Track& track):
+            ExportTrackOperationWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, const std::string& filename, const Track& track, Track::ExportFormat format):
                 AsyncOperationWindow(obj, builder),
                 filename(filename),
-                track(track)
+                track(track),
+                format(format)
             {
             }
 
             void on_run() override
             {
-                track.export_to_wave_file(filename.c_str(), *this);
+                track.export_to_wave_file(filename.c_str(), *this, format);
             }
 
             void on_finished() override
             {
+                try {
+                    rethrow_exception();
+                }
+                catch (std::exception& e) {
+                    Gtk::MessageDialog errdlg(*this, e.what(), false, Gtk::MESSAGE_ERROR, Gtk::BUTTONS_CLOSE);
+                    errdlg.run();
+                }
             }
         };
 
+        const std::string choice=dlg.get_choice("format");
+
+        Track::ExportFormat format=Track::ExportFormat::Wave16;
+        if (choice=="wave24")
+            format=Track::ExportFormat::Wave24;
+        else if (choice=="wavefloat")
+            format=Track::ExportFormat::WaveFloat;
+        else if (choice=="flac")
+            format=Track::ExportFormat::FLAC;
+        else if (choice=="raw")
+            format=Track::ExportFormat::Raw;
+
+        // exporting renders from the synth frames, which are only computed for tracks played so far
+        controller->compute_synth_frames();
+
         auto builder=Gtk::Builder::create_from_resource("/opt/meow/asyncoperationwindow.ui");
 
         ExportTrackOperationWindow* asyncopwnd;
-        builder->get_widget_derived("asyncopwnd", asyncopwnd, dlg.get_filename(), *project->tracks[0]);
+        builder->get_widget_derived("asyncopwnd", asyncopwnd, dlg.get_filename(), *project->tracks[0], format);
 
         asyncopwnd->run();
     }
@@ -136,4 +307,6 @@ void MainWindow::on_bpm_changed()
 {
     project->bpm=bpm->get_value();
     project->beat_subdivisions=beat_subdivisions->get_value();
+
+    project->record_settings();
 }
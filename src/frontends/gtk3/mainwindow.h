@@ -1,15 +1,20 @@
 #pragma once
 
+#include <thread>
+#include <exception>
+#include <optional>
 #include "intonationeditor.h"
+#include "project.h"
 
 
-class Project;
 class Controller;
 
 
 class MainWindow:public Gtk::ApplicationWindow {
 public:
-    MainWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, std::unique_ptr<Project>&&);
+    // the file name is empty for projects which have not been saved yet
+    MainWindow(BaseObjectType* obj, const Glib::RefPtr<Gtk::Builder>& builder, std::unique_ptr<Project>&&, const std::string& filename);
+    ~MainWindow();
 
 protected:
     void on_size_allocate(Gtk::Allocation& allocation) override;
@@ -17,9 +22,15 @@ protected:
 private:
     void on_undo();
     void on_save_project();
+    bool on_autosave();
+    void on_saved();
     void on_export_track();
     void on_bpm_changed();
 
+    void save(const std::string& filename, bool autosave);
+    void finish_save();
+    void commit_save();
+
     std::unique_ptr<Project>        project;
     std::unique_ptr<Controller>     controller;
     
@@ -30,5 +41,24 @@ private:
 
     Glib::RefPtr<Gtk::Adjustment>   bpm;
     Glib::RefPtr<Gtk::Adjustment>   beat_subdivisions;
+
+    std::string                     filename;
+
+    /* Saving happens on a thread of its own, one save at a time, by either writing the project file in full or
+     * appending to its journal. Autosaving records the edits in the journal without saving them. A save requested
+     * while another one is going on is started once that has finished. */
+    static constexpr int            autosave_interval=10;   // seconds
+
+    std::thread                     savethread;
+    Glib::Dispatcher                dispatch_saved;
+    bool                            saving=false;
+    bool                            autosaving=false;
+    bool                            autosavefailed=false;
+    std::string                     savefilename;
+    std::exception_ptr              saveexception;
+    std::optional<std::string>      queuedsave;
+
+    std::optional<Project::Snapshot>        pendingsnapshot;
+    std::optional<Project::JournalUpdate>   pendingupdate;
 };
 
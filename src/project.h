@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <string>
 #include "track.h"
 
 struct Project {
@@ -10,9 +11,121 @@ struct Project {
 
     std::vector<std::unique_ptr<Track>>     tracks;
 
+    /* Reads files of either format, mapping the sample data of the current one into memory or decoding it in the
+     * background, and replays the edits saved in the journal. Synth frames are left to be computed for those tracks
+     * which are actually played or exported. */
+    void read(const char* filename);
+    enum class SampleEncoding {
+        Raw,        // mapped into memory when read
+        Compressed  // lossless, at a fraction of the size, but decoded when read
+    };
+
+    /* Everything needed to write the project file. Taking a snapshot is cheap, since only the metadata is serialized
+     * right away, while the sample data is shared as it is never modified. The snapshot may then be written on any
+     * thread while editing goes on. */
+    class Snapshot {
+    public:
+        // replaces the file as a whole once the new one is safely on disk, so that it is never left half written
+        void write(const char* filename, SampleEncoding=SampleEncoding::Compressed) const;
+
+    private:
+        friend struct Project;
+
+        std::string                                     metadata;
+        std::vector<std::shared_ptr<const Waveform>>    waves;
+
+        uint32_t                                        generation;
+        size_t                                          editcount;  // of the edits recorded so far
+    };
+
+    Snapshot take_snapshot();
+
+    void write(const char* filename, SampleEncoding=SampleEncoding::Compressed);
+
+    /* Edits are recorded in a journal next to the project file, which is replayed when the file is read. Each time
+     * the edits are saved, a marker is appended, and those beyond the last marker have not been saved but may be
+     * recovered after a crash. Appending to the journal takes time in proportion to the edits only, while writing
+     * the file in full, which starts a new journal, is left for when the journal has grown large. */
+    struct Edit {
+        enum class Type:uint8_t {
+            Chunks      =1,
+            Settings    =2
+        };
+
+        Type            type;
+        uint32_t        track=0;
+        Track::Edit     chunks;
+        double          bpm=0.0;
+        int             beat_subdivisions=0;
+    };
+
+    void record_edit(uint32_t track, Track::Edit&&);
+    // records the current bpm and beat subdivisions
+    void record_settings();
+
+    // the edits not recorded in the journal yet, to be appended on any thread like a snapshot is written
+    class JournalUpdate {
+    public:
+        void append(const char* filename) const;
+
+    private:
+        friend struct Project;
+
+        uint32_t        generation;
+        uint64_t        offset;     // where the records go, replacing anything beyond
+        std::string     records;
+        size_t          editcount;
+        bool            save;
+    };
+
+    // whether edits can be appended to the journal of the file the project was last read from or written to in full
+    bool has_journal() const
+    {
+        return generation!=0;
+    }
+
+    bool journal_needs_compaction() const;
+
+    bool has_pending_edits() const
+    {
+        return !edits.empty();
+    }
+
+    // with save set, the edits count as saved once appended
+    JournalUpdate take_journal_update(bool save);
+
+    // to be called once a snapshot or journal update taken from this project has been written successfully
+    void commit(const Snapshot&);
+    void commit(const JournalUpdate&);
+
+    // edits found in the journal beyond the last save, which are only applied on request
+    bool has_unsaved_edits() const
+    {
+        return !unsaved.empty();
+    }
+
+    void recover_unsaved_edits();
+
+    // drops edits from the journal which have not been saved, as when closing the project without saving
+    void discard_unsaved_edits(const char* filename);
+
+    // the format of earlier versions, in which the sample data is part of the archive
     void read(std::istream&);
-    void write(std::ostream&);
 
     template<typename Archive>
     void serialize(Archive& ar, uint32_t ver);
+
+private:
+    void read_journal(const std::string& filename);
+    bool can_apply(const std::vector<Edit>&) const;
+    void apply_edit(const Edit&);
+
+    std::vector<Edit>   edits;          // not recorded in the journal yet
+
+    uint32_t            generation=0;   // identifies the project file to its journal, 0 if there is none
+    uint64_t            journalsize=0;  // of the part of the journal reflected by the project, 0 if there is none
+    uint64_t            savedsize=0;    // of the part up to the last save
+
+    std::vector<Edit>   unsaved;
+    uint64_t            unsavedsize=0;  // of the journal including the unsaved edits
 };
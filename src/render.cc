@@ -1,86 +1,722 @@
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "audio.h"
 #include "render.h"
 
 
-class RenderAudioProvider:public IAudioProvider {
+class RenderCache:public IRenderCache {
+public:
+    RenderCache(const Track& track, Waveform::Interpolation);
+    virtual ~RenderCache();
+
+    virtual void invalidate(double begin, double end) override;
+
+    virtual void set_preview(double begin, double end, std::vector<Track::SynthFrame>&& frames) override;
+
+    virtual std::shared_ptr<IAudioProvider> create_audio_provider(const Track::Chunk* first, const Track::Chunk* last) override;
+    virtual std::shared_ptr<ITransport> create_transport() override;
+
+    struct Preview {
+        double                          begin;
+        double                          end;
+
+        // how far around [begin, end) the output differs from that of the track
+        float                           margin;
+
+        std::vector<Track::SynthFrame>  frames;
+    };
+
+    // serves only output which is the same for the given version of the synth frames as for the current one
+    long read(float* buffer, long begin, long end, long version, bool& available);
+
+    // the synth frames currently rendered, along with their reach and version
+    std::shared_ptr<const Track::SynthFrames> get_frames(float& reach, long& version);
+
+    // the preview returned remains valid until released
+    const Preview* acquire_preview();
+    void release_preview();
+
+private:
+    struct Block {
+        // the first version of the synth frames the samples hold for, i.e. the last one invalidating the block
+        long                version;
+        std::vector<float>  samples;
+    };
+
+    static constexpr long   blocklength=16384;
+
+    const Track&                        track;
+    Waveform::Interpolation             interpolation;
+
+    /* Blocks are read by the audio thread without locking, so invalidated blocks are only deleted once no reader
+     * can still be accessing them, i.e. when there are no readers at some point after they have been unlinked. */
+    std::vector<std::atomic<Block*>>    blocks;
+    std::vector<long>                   invalidated;    // the version which invalidated each block most recently
+    long                                missing;
+
+    std::atomic<int>                    readers=0;
+    std::vector<Block*>                 retired;
+
+    std::atomic<Preview*>               preview=nullptr;
+    std::vector<Preview*>               retiredpreviews;
+
+    /* The synth frames rendered, and how far their grains extend from their centers at most. The reach is only
+     * ever raised by the frames of an invalidated range, so that it may overestimate after edits, which merely
+     * widens the ranges of frames searched. */
+    std::shared_ptr<const Track::SynthFrames>   frames;
+    float                               reach=0.0f;
+
+    // incremented on every invalidation, so that blocks rendered from outdated frames can be discarded
+    long                                version=0;
+
+    std::mutex                          mutex;
+    std::condition_variable             cond;
+    std::thread                         worker;
+    bool                                stopping=false;
+
+    // position of the most recent playback, near which missing blocks are rendered first
+    std::atomic<long>                   playhead=0;
+
+    void update_reach(double begin, double end);
+    void delete_retired();
+    void run();
+};
+
+
+class RenderAudioProvider:public ITransport {
     const Track&        track;
     const Waveform&     wave;
 
-    Track::Chunk*       firstchunk;
-    Track::Chunk*       lastchunk;
-    Track::Chunk*       curchunk;
+    const Track::Chunk* firstchunk;
+    const Track::Chunk* lastchunk;
+    const Track::Chunk* curchunk;
     
+    Waveform::Interpolation interpolation;
+
+    RenderCache*        cache;
+
     long                ptr;
-    int                 synthhead;
-    int                 synthtail;
+    // the version of the synth frames played, which is kept for the lifetime of the provider
+    std::shared_ptr<const Track::SynthFrames>   frames;
+    long                framesversion;
+
+    // how far grains extend from their centers at most, which bounds the frames sounding at any position
+    float               reach=0.0f;
+
+    Track::SynthFrames::Cursor  synthhead;
+    Track::SynthFrames::Cursor  synthtail;
+    bool                exhausted=false;
+
+    // whether to wait for further requests at the end of the track rather than finish
+    bool                holdatend;
+
+    // requests from the user interface, taken over by the audio thread at the beginning of each block
+    static constexpr long   nopos=LONG_MIN;
+
+    std::atomic<long>   seekrequest=nopos;
+    std::atomic<long>   scrubrequest=nopos;
+
+    // the loop region changes as a whole, and fits into a lock-free atomic with 32 bit positions, which cover hours of output
+    struct LoopRegion {
+        int32_t begin;
+        int32_t end;
+    };
+
+    std::atomic<LoopRegion> loop=LoopRegion { 0, 0 };
+
+    // after wrapping around, grains centered before the beginning of the loop are left out, as they belong to the
+    // output preceding the loop; grains which were still sounding at the end of the loop are kept playing shifted
+    // back by the length of the loop, so that they overlap the restart just as the grains following them would
+    double              loopcut=-HUGE_VAL;
+
+    Track::SynthFrames::Cursor  looptailfirst;
+    Track::SynthFrames::Cursor  looptaillast;
+    long                looptailshift=0;
+    double              looptailcut=-HUGE_VAL;
+    double              looptailend=HUGE_VAL;
+
+    static constexpr long   scrublength=2048;
+    static constexpr long   scrubfade  =256;
+
+    // samples left to play of the current scrub grain, or negative if not scrubbing
+    long                scrubremaining=-1;
+
+    void reposition(long position);
+    void wrap_loop(long loopbegin, long loopend);
 
 public:
-    RenderAudioProvider(const Track& track, Track::Chunk* firstchunk, Track::Chunk* lastchunk);
+    RenderAudioProvider(const Track& track, const Track::Chunk* firstchunk, const Track::Chunk* lastchunk, Waveform::Interpolation, RenderCache* cache, bool holdatend=false);
     
     virtual unsigned long provide(float* buffer, unsigned long count) override;
+
+    virtual void seek(long position) override;
+    virtual void set_loop(long begin, long end) override;
+    virtual void scrub(long position) override;
+};
+
+
+// raised cosine fade-in 0.5*(1-cos(pi*u)) for 0<=u<=1, tabulated finely enough for linear interpolation to be accurate to float precision
+class FadeTable {
+    static constexpr int    size=4096;
+
+    float   values[size+2];
+
+public:
+    FadeTable()
+    {
+        for (int i=0;i<=size+1;i++)
+            values[i]=0.5f * (1.0f-cosf(M_PI*std::min(i, size)/size));
+    }
+
+    float operator()(float u) const
+    {
+        u*=size;
+
+        const int i=std::clamp((int) u, 0, size);
+        const float t=u - i;
+
+        return values[i]*(1.0f-t) + values[i+1]*t;
+    }
 };
 
+static const FadeTable fade;
+
+
+// number of samples for which window gains are computed at once
+static constexpr long windowblock=256;
+
+// covers the stencil of the widest interpolation kernel
+static constexpr long stencilmargin=8;
+
+
+// range of source samples read by the grain of a frame
+static std::pair<long, long> get_source_range(const Track::SynthFrame& sf)
+{
+    return { (long) floor(sf.tbegin()+sf.soffset) - stencilmargin, (long) ceil(sf.tend()+sf.soffset) + stencilmargin };
+}
+
 
-std::shared_ptr<IAudioProvider> create_render_audio_provider(const Track& track, Track::Chunk* first, Track::Chunk* last)
+// the audio thread must not wait for sample data still being decoded, so grains reading any are left out
+static bool is_source_available(const Waveform& wave, const Track::SynthFrame& sf)
 {
-    return std::make_shared<RenderAudioProvider>(track, first, last);
+    const auto [begin, end]=get_source_range(sf);
+    return wave.is_available(begin, end);
 }
 
 
-RenderAudioProvider::RenderAudioProvider(const Track& track, Track::Chunk* firstchunk, Track::Chunk* lastchunk):
+static void render_frame(const Waveform& wave, Waveform::Interpolation interpolation, float* buffer, long begin, long end, const Track::SynthFrame& sf)
+{
+    const long rise=std::max(begin, (long) ceil(sf.tbegin()));
+
+    // grains of frames rendered into a range split at cache blocks may well start past its end
+    if (rise>=end) return;
+
+    const long fall=std::clamp((long) ceil(sf.tmid),   rise, end);
+    const long stop=std::clamp((long) ceil(sf.tend()), fall, end);
+
+    // source and output positions differ by a constant, so the interpolation weights are the same for all samples of a grain
+    const long  offset=(long) floor(sf.soffset);
+    const float frac  =sf.soffset - offset;
+
+    float grain[windowblock];
+    float gain [windowblock];
+
+    for (long from=rise; from<stop; from+=windowblock) {
+        const long to=std::min(from+windowblock, stop);
+
+        for (long p=from; p<std::min(to, fall); p++)
+            gain[p-from]=fade(float(p-sf.tmid+sf.left) / sf.left) * sf.amplitude;
+
+        for (long p=std::max(from, fall); p<to; p++)
+            gain[p-from]=fade(1.0f - float(p-sf.tmid) / sf.right) * sf.amplitude;
+
+        wave.interpolate(grain, from+offset, frac, to-from, interpolation);
+
+        float* out=buffer + (from-begin);
+
+        for (long j=0;j<to-from;j++)
+            out[j]+=grain[j] * gain[j];
+    }
+}
+
+
+void render_synth_frames(const Waveform& wave, const Track::SynthFrames& frames, int first, int last, float* buffer, long begin, long end, Waveform::Interpolation interpolation)
+{
+    if (first<last) {
+        long sourcebegin=LONG_MAX, sourceend=LONG_MIN;
+
+        for (auto it=frames.cursor(first), end=frames.cursor(last); it!=end; ++it) {
+            const auto [from, to]=get_source_range(*it);
+            sourcebegin=std::min(sourcebegin, from);
+            sourceend  =std::max(sourceend,   to);
+        }
+
+        wave.fetch(sourcebegin, sourceend);
+    }
+
+    for (auto it=frames.cursor(first), stop=frames.cursor(last); it!=stop; ++it)
+        render_frame(wave, interpolation, buffer, begin, end, *it);
+}
+
+
+IRenderCache::~IRenderCache()
+{
+}
+
+
+IRenderCache* IRenderCache::create(const Track& track, Waveform::Interpolation interpolation)
+{
+    return new RenderCache(track, interpolation);
+}
+
+
+RenderCache::RenderCache(const Track& track, Waveform::Interpolation interpolation):track(track), interpolation(interpolation)
+{
+    const long length=lrint(track.get_last_chunk()->end);
+
+    blocks=std::vector<std::atomic<Block*>>((length + blocklength - 1) / blocklength);
+    for (auto& block: blocks)
+        block=nullptr;
+
+    invalidated=std::vector<long>(blocks.size(), 0);
+    missing=blocks.size();
+
+    frames=track.get_synth_frames();
+    update_reach(-HUGE_VAL, HUGE_VAL);
+
+    worker=std::thread(&RenderCache::run, this);
+}
+
+
+RenderCache::~RenderCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping=true;
+        cond.notify_all();
+    }
+
+    worker.join();
+
+    for (auto& block: blocks)
+        delete block.load();
+
+    for (Block* block: retired)
+        delete block;
+
+    delete preview.load();
+
+    for (Preview* preview: retiredpreviews)
+        delete preview;
+}
+
+
+void RenderCache::invalidate(double begin, double end)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const long first=std::max((long) floor(begin / blocklength), 0L);
+    const long last =std::min((long) ceil (end   / blocklength), (long) blocks.size());
+
+    version++;
+
+    for (long i=first;i<last;i++) {
+        if (Block* block=blocks[i].exchange(nullptr)) {
+            retired.push_back(block);
+            missing++;
+        }
+
+        invalidated[i]=version;
+    }
+
+    if (Preview* oldpreview=preview.exchange(nullptr))
+        retiredpreviews.push_back(oldpreview);
+
+    frames=track.get_synth_frames();
+
+    // all frames whose grains changed are centered within the invalidated range
+    update_reach(begin, end);
+    delete_retired();
+
+    cond.notify_all();
+}
+
+
+// must be called with the cache locked
+void RenderCache::update_reach(double begin, double end)
+{
+    for (auto it=frames->cursor(frames->find(begin)), last=frames->cursor(frames->find(end)); it!=last; ++it)
+        reach=std::max({ reach, it->left, it->right });
+}
+
+
+void RenderCache::set_preview(double begin, double end, std::vector<Track::SynthFrame>&& frames)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Preview* newpreview=new Preview { begin, end, reach, std::move(frames) };
+
+    for (const auto& sf: newpreview->frames)
+        newpreview->margin=std::max({ newpreview->margin, sf.left, sf.right });
+
+    if (Preview* oldpreview=preview.exchange(newpreview))
+        retiredpreviews.push_back(oldpreview);
+
+    delete_retired();
+}
+
+
+// must be called with the cache locked
+void RenderCache::delete_retired()
+{
+    if (readers>0)
+        return;
+
+    for (Block* block: retired)
+        delete block;
+
+    for (Preview* preview: retiredpreviews)
+        delete preview;
+
+    retired.clear();
+    retiredpreviews.clear();
+}
+
+
+std::shared_ptr<IAudioProvider> RenderCache::create_audio_provider(const Track::Chunk* first, const Track::Chunk* last)
+{
+    return std::make_shared<RenderAudioProvider>(track, first, last, interpolation, this);
+}
+
+
+std::shared_ptr<ITransport> RenderCache::create_transport()
+{
+    return std::make_shared<RenderAudioProvider>(track, track.get_first_chunk(), track.get_last_chunk(), interpolation, this, true);
+}
+
+
+/* Copies cached output starting at begin, up to end or the end of the block containing begin, whichever comes first,
+ * and returns the number of samples covered. If the block is not available, the buffer is left untouched. */
+long RenderCache::read(float* buffer, long begin, long end, long version, bool& available)
+{
+    const long index=begin>=0 ? begin/blocklength : -((blocklength-1-begin) / blocklength);
+    end=std::min(end, (index+1)*blocklength);
+
+    playhead=begin;
+
+    readers++;
+
+    const Block* block=index>=0 && index<(long) blocks.size() ? blocks[index].load() : nullptr;
+
+    // cached output is outdated where the preview differs from the track
+    if (const Preview* pv=preview.load())
+        if (end>pv->begin-pv->margin && begin<pv->end+pv->margin)
+            block=nullptr;
+
+    // blocks re-rendered after an edit of their span differ from what older frames produce there
+    available=block && block->version<=version;
+    if (available) {
+        const long offset=begin - index*blocklength;
+        std::copy(block->samples.begin()+offset, block->samples.begin()+offset+(end-begin), buffer);
+    }
+
+    readers--;
+
+    return end-begin;
+}
+
+
+std::shared_ptr<const Track::SynthFrames> RenderCache::get_frames(float& reach, long& version)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    reach  =this->reach;
+    version=this->version;
+    return frames;
+}
+
+
+const RenderCache::Preview* RenderCache::acquire_preview()
+{
+    readers++;
+
+    const Preview* pv=preview.load();
+    if (!pv)
+        readers--;
+
+    return pv;
+}
+
+
+// must only be called after acquire_preview() returned a preview
+void RenderCache::release_preview()
+{
+    readers--;
+}
+
+
+void RenderCache::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;) {
+        cond.wait(lock, [this]() { return stopping || missing>0; });
+        if (stopping) break;
+
+        // render the first missing block at or after the playhead, wrapping around at the end
+        const long start=std::clamp(playhead/blocklength, 0L, (long) blocks.size()-1);
+
+        long index=start;
+        while (blocks[index])
+            if (++index==(long) blocks.size())
+                index=0;
+
+        const long begin=index*blocklength;
+        const long end  =begin + blocklength;
+
+        // render without holding the lock, from the frames current at this point
+        const long  renderversion=version;
+        const long  validsince   =invalidated[index];
+        const auto  renderframes =frames;
+        const float renderreach  =reach;
+
+        lock.unlock();
+
+        Block* block=new Block { validsince, std::vector<float>(blocklength, 0.0f) };
+
+        render_synth_frames(
+            track.get_waveform(),
+            *renderframes,
+            renderframes->find(begin-renderreach),
+            renderframes->find(end  +renderreach),
+            block->samples.data(),
+            begin,
+            end,
+            interpolation);
+
+        lock.lock();
+
+        // the block may have been invalidated while rendering
+        if (version==renderversion) {
+            blocks[index]=block;
+            missing--;
+        }
+        else
+            delete block;
+
+        delete_retired();
+    }
+}
+
+RenderAudioProvider::RenderAudioProvider(const Track& track, const Track::Chunk* firstchunk, const Track::Chunk* lastchunk, Waveform::Interpolation interpolation, RenderCache* cache, bool holdatend):
     track(track), 
     wave(track.get_waveform()),
     firstchunk(firstchunk),
     lastchunk(lastchunk),
-    curchunk(firstchunk)
+    curchunk(firstchunk),
+    interpolation(interpolation),
+    cache(cache),
+    holdatend(holdatend)
+{
+    frames=cache->get_frames(reach, framesversion);
+
+    synthhead=synthtail=frames->cursor(frames->find(firstchunk->begin));
+
+    ptr=lrint(synthhead->tbegin());
+}
+
+
+void RenderAudioProvider::seek(long position)
+{
+    seekrequest=position;
+}
+
+
+void RenderAudioProvider::set_loop(long begin, long end)
+{
+    loop=LoopRegion { int32_t(begin), int32_t(end) };
+}
+
+
+void RenderAudioProvider::scrub(long position)
+{
+    scrubrequest=position;
+}
+
+
+// only grains centered within reach of the new position can be sounding there, so this is a binary search
+void RenderAudioProvider::reposition(long position)
+{
+    synthhead=synthtail=frames->cursor(frames->find(position-reach));
+    exhausted=synthhead.get_index()==frames->size();
+
+    ptr=position;
+
+    loopcut=-HUGE_VAL;
+    looptailfirst=looptaillast=Track::SynthFrames::Cursor();
+}
+
+
+void RenderAudioProvider::wrap_loop(long loopbegin, long loopend)
 {
-    synthhead=synthtail=track.get_first_synth_frame_index(firstchunk);
+    looptailfirst=synthtail;
+    looptaillast =synthhead;
+    looptailshift=loopend - loopbegin;
+    looptailcut  =loopcut;
+    looptailend  =loopend;
+
+    synthhead=synthtail=frames->cursor(frames->find(loopbegin));
+    exhausted=synthhead.get_index()==frames->size();
 
-    ptr=lrint(track.get_synth_frame(synthhead).tbegin);
+    ptr=loopbegin;
+
+    loopcut=loopbegin;
 }
 
 
 unsigned long RenderAudioProvider::provide(float* buffer, unsigned long count)
 {
-    if (terminating && synthhead==synthtail)
+    if (const long position=seekrequest.exchange(nopos); position!=nopos) {
+        reposition(position);
+        scrubremaining=-1;
+    }
+
+    if (const long position=scrubrequest.exchange(nopos); position!=nopos) {
+        reposition(position);
+        scrubremaining=scrublength;
+    }
+
+    if (terminating && (synthhead==synthtail || scrubremaining==0))
         return 0;
-    
-    unsigned long done=0;
-
-    while (count--) {
-        if (!terminating) {
-            while (track.get_synth_frame(synthhead).tbegin<=ptr) {
-                if (++synthhead==track.get_synth_frame_count()) {
-                    terminating=true;
-                    break;
-                }
+
+    if (exhausted && synthhead==synthtail && !holdatend)
+        return 0;
+
+    if (scrubremaining==0 || (exhausted && synthhead==synthtail)) {
+        std::fill(buffer, buffer+count, 0.0f);
+        return count;
+    }
+
+    const LoopRegion region   =loop;
+    const bool       looping  =region.end>region.begin;
+    const long       loopbegin=region.begin;
+    const long       loopend  =region.end;
+
+    const long begin=ptr;
+    long       end  =ptr+count;
+
+    // stop exactly at the end of the loop or scrub grain, the remaining samples are provided by the next call
+    if (looping && begin<loopend && end>loopend)
+        end=loopend;
+
+    if (scrubremaining>0)
+        end=std::min(end, begin+scrubremaining);
+
+    count=end - begin;
+
+    if (!terminating && !exhausted) {
+        while (synthhead->tbegin()<=end-1) {
+            if ((++synthhead).get_index()==frames->size()) {
+                exhausted=true;
+                break;
             }
         }
+    }
+    std::fill(buffer, buffer+count, 0.0f);
+
+    // grains centered at or after the end of the loop are not heard before wrapping around
+    const double cutend=looping && begin<loopend ? loopend : HUGE_VAL;
+
+    auto is_played=[this, cutend] (const Track::SynthFrame& sf) {
+        return sf.tmid>=loopcut && sf.tmid<cutend && is_source_available(wave, sf);
+    };
+
+    // the cache holds the output of all grains, so it cannot serve where some of them are left out at the loop
+    const bool nearcut=(begin<loopcut+reach && end>loopcut) || (begin<cutend && end>cutend-reach);
 
-        float out=0.0f;
+    // serve as much as possible from the cache, and render whatever is missing on the spot; once terminating,
+    // only the frames already started are rendered so that they can decay
+    for (long from=begin; from<end;) {
+        bool available=false;
+        const long to=!terminating && !nearcut ? from + cache->read(buffer+(from-begin), from, end, framesversion, available) : end;
 
-        for (int i=synthtail;i<synthhead;i++) {
-            const auto& sf=track.get_synth_frame(i);
+        if (!available) {
+            const RenderCache::Preview* preview=!terminating ? cache->acquire_preview() : nullptr;
 
-            double s=(ptr - sf.tmid)*sf.stretch + sf.smid;
+            // overlap-add one grain at a time over the entire block
+            for (auto it=synthtail; it!=synthhead; ++it) {
+                const auto& sf=*it;
 
-            if (ptr<sf.tmid) {
-                float u=float(ptr-sf.tbegin) / float(sf.tmid-sf.tbegin);
-                out+=wave(s) * (1.0f-cosf(M_PI*u)) * 0.5f * sf.amplitude;
+                if ((!preview || sf.tmid<preview->begin || sf.tmid>=preview->end) && is_played(sf))
+                    render_frame(wave, interpolation, buffer+(from-begin), from, to, sf);
             }
-            else if (ptr<sf.tend) {
-                float u=float(ptr-sf.tmid) / float(sf.tend-sf.tmid);
-                out+=wave(s) * (1.0f+cosf(M_PI*u)) * 0.5f * sf.amplitude;
+
+            if (preview) {
+                auto by_tmid=[] (const Track::SynthFrame& sf, double t) {
+                    return sf.tmid < t;
+                };
+
+                auto first=std::lower_bound(preview->frames.begin(), preview->frames.end(), from-preview->margin, by_tmid);
+                auto last =std::lower_bound(first,                   preview->frames.end(), to  +preview->margin, by_tmid);
+
+                for (auto it=first; it!=last; it++)
+                    if (is_played(*it))
+                        render_frame(wave, interpolation, buffer+(from-begin), from, to, *it);
+
+                cache->release_preview();
             }
         }
 
-        buffer[done++]=out;
-        ptr++;
+        from=to;
+    }
+
+    // grains centered after the beginning of the loop rise before it, so they start playing ahead of wrapping around,
+    // overlapping the grains which end the loop
+    if (looping && begin<loopend && end>loopend-reach) {
+        const long shift=loopend - loopbegin;
+
+        for (auto it=frames->cursor(frames->find(loopbegin)), last=frames->cursor(frames->find(loopbegin+reach)); it!=last; ++it) {
+            const auto& sf=*it;
+
+            if (sf.tmid<loopend && is_source_available(wave, sf))
+                render_frame(wave, interpolation, buffer, begin-shift, end-shift, sf);
+        }
+    }
+
+    for (auto it=looptailfirst; it!=looptaillast; ++it) {
+        const auto& sf=*it;
+
+        if (sf.tmid>=looptailcut && sf.tmid<looptailend && is_source_available(wave, sf))
+            render_frame(wave, interpolation, buffer, begin+looptailshift, end+looptailshift, sf);
+    }
+
+    if (scrubremaining>0) {
+        for (long p=begin; p<end; p++) {
+            const long offset=scrublength - scrubremaining + (p-begin);
+            buffer[p-begin]*=fade(float(std::min(offset, scrublength-offset)) / scrubfade);
+        }
 
-        while (synthtail<synthhead && track.get_synth_frame(synthtail).tend<=ptr)
-            synthtail++;
+        scrubremaining-=count;
     }
 
-    return done;
+    ptr=end;
+
+    while (synthtail<synthhead && synthtail->tend()<=ptr)
+        ++synthtail;
+
+    while (looptailfirst<looptaillast && looptailfirst->tend()<=ptr+looptailshift)
+        ++looptailfirst;
+
+    if (looping && ptr==loopend)
+        wrap_loop(loopbegin, loopend);
+
+    return count;
 }
+
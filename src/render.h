@@ -3,4 +3,43 @@
 #include "audio.h"
 #include "track.h"
 
-std::shared_ptr<IAudioProvider> create_render_audio_provider(const Track& track, Track::Chunk* first, Track::Chunk* last);
+/* Playback of a track which can be repositioned while it is running. Positions are sample indices in the output, and
+ * the control methods are meant to be called from the user interface while the audio thread is playing. */
+class ITransport:public IAudioProvider {
+public:
+    virtual void seek(long position) = 0;
+
+    // jumps back to begin whenever playback reaches end, or stops looping if end<=begin
+    virtual void set_loop(long begin, long end) = 0;
+
+    // plays a short faded grain of output at position, then falls silent until the next scrub or seek
+    virtual void scrub(long position) = 0;
+};
+
+
+// overlap-adds the synth frames [first, last) into buffer, which holds the output samples [begin, end); grains are clipped to that range
+void render_synth_frames(const Waveform& wave, const Track::SynthFrames& frames, int first, int last, float* buffer, long begin, long end, Waveform::Interpolation);
+
+
+/* Renders the output of a track ahead of time on a background thread, so that playback can be served from memory
+ * instead of being synthesized in the audio callback. The time span affected by a change of the synth frames of
+ * the track must be invalidated after the new frames have been published.
+ *
+ * Audio providers play the version of the synth frames current at their creation until they finish, so edits are
+ * only heard from providers created after them. Cached output is tagged with the versions it holds for, and served
+ * only to providers of these versions, while others render the invalidated spans on the spot from their own frames. */
+class IRenderCache {
+public:
+    virtual ~IRenderCache();
+
+    virtual void invalidate(double begin, double end) = 0;
+
+    // frames to be played in place of those of the track centered in [begin, end), until the next invalidation
+    virtual void set_preview(double begin, double end, std::vector<Track::SynthFrame>&& frames) = 0;
+
+    virtual std::shared_ptr<IAudioProvider> create_audio_provider(const Track::Chunk* first, const Track::Chunk* last) = 0;
+    virtual std::shared_ptr<ITransport> create_transport() = 0;
+
+    // playback uses the cheaper cubic interpolation by default, while exports use windowed sinc interpolation
+    static IRenderCache* create(const Track&, Waveform::Interpolation=Waveform::Interpolation::Cubic);
+};
@@ -1,7 +1,22 @@
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cereal/archives/binary.hpp>
 #include <cereal/types/memory.hpp>
 #include <cereal/types/vector.hpp>
 #include "project.h"
+#include "compression.h"
 
 
 const uint32_t file_header_magic=0x776f656d;
@@ -9,6 +24,159 @@ const uint32_t track_header_magic=0x206b7274;
 const uint32_t waveform_header_magic=0x65766177;
 
 
+/* Project files consist of a header and a table of sections, followed by the sections themselves, each of which
+ * starts at a page boundary. The project and its tracks are stored in a metadata section as a cereal archive, while
+ * the sample data and analysis frames of each track are stored raw in sections of their own, so that they can be
+ * mapped into memory instead of being read. Like the cereal archive, everything is in the byte order of the machine.
+ * Readers skip sections of unknown types, and files starting with file_header_magic are from earlier versions,
+ * consisting of nothing but the cereal archive. */
+const uint32_t container_magic=0x574f454d;
+const uint32_t container_version=1;
+const uint64_t section_alignment=4096;
+
+enum class SectionType:uint32_t {
+    Metadata            =1,
+    Samples             =2,
+    Frames              =3,
+    CompressedSamples   =4  // alternative to Samples
+};
+
+struct ContainerHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    sectioncount;
+    uint32_t    generation;     // random, to tell whether a journal belongs to the file, 0 in files without one
+};
+
+struct SectionEntry {
+    uint32_t    type;
+    uint32_t    track;      // index of the track a section belongs to, if any
+    uint64_t    offset;     // from the beginning of the file
+    uint64_t    size;
+};
+
+// precedes the sample data, which is padded with Waveform::guard zero samples on either side
+struct SampleSectionHeader {
+    int64_t     length;
+    int32_t     samplerate;
+    uint32_t    reserved[13];
+};
+
+// keeps the sample data following the header as aligned as that of waveforms in memory
+static_assert(sizeof(SampleSectionHeader)==64 && Waveform::guard*sizeof(float)%64==0, "misaligned sample data");
+/* Precedes a table with the offsets of the compressed blocks relative to the beginning of the section, with one more
+ * entry marking the end of the last block, followed by the blocks themselves. */
+struct CompressedSampleSectionHeader {
+    int64_t     length;
+    int32_t     samplerate;
+    uint32_t    blocksize;
+};
+
+static_assert(sizeof(Waveform::Frame)==16 && std::is_trivially_copyable<Waveform::Frame>::value, "unexpected frame layout");
+
+
+/* The journal next to a project file consists of a header followed by records, each of which is a cereal archive
+ * starting with the record type, preceded by its size and checksum. Records are only ever appended, or cut off when
+ * unsaved edits are discarded, so a crash can at worst leave the last record incomplete, which is then ignored along
+ * with anything after it. */
+const uint32_t journal_magic=0x4c4e524a;
+const uint32_t journal_version=1;
+
+// the size at which the project file is written in full on the next save, starting a new journal
+const uint64_t journal_compaction_size=1<<20;
+
+struct JournalHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    generation;     // of the project file the journal belongs to
+    uint32_t    reserved;
+};
+
+struct JournalRecordHeader {
+    uint32_t    size;
+    uint32_t    checksum;
+};
+
+// record type marking the end of the edits saved, besides those of Project::Edit::Type
+const uint8_t journal_save_record=0;
+
+
+// a whole file mapped into memory read-only, which stays valid even if the file is replaced in the meantime
+class MappedFile {
+public:
+    MappedFile(const char* filename);
+    ~MappedFile();
+
+    const char* get_data() const
+    {
+        return static_cast<const char*>(data);
+    }
+
+    uint64_t get_size() const
+    {
+        return size;
+    }
+
+private:
+    void*       data=MAP_FAILED;
+    uint64_t    size=0;
+};
+
+
+MappedFile::MappedFile(const char* filename)
+{
+    int fd=open(filename, O_RDONLY);
+    if (fd<0)
+        throw std::runtime_error(std::string(filename) + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st)==0 && st.st_size>0) {
+        size=st.st_size;
+        data=mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    if (data==MAP_FAILED)
+        throw std::runtime_error("Bad file format");
+}
+
+
+MappedFile::~MappedFile()
+{
+    if (data!=MAP_FAILED)
+        munmap(data, size);
+}
+
+
+// distributes count items across threads in contiguous ranges, unless there are too few to be worthwhile
+template<typename Fn>
+static void parallel_for(long count, Fn&& fn)
+{
+    const int nthreads=std::clamp<long>(count/16, 1, std::max(std::thread::hardware_concurrency(), 1u));
+
+    std::vector<std::thread> threads;
+    for (int i=1;i<nthreads;i++)
+        threads.emplace_back(fn, count*i/nthreads, count*(i+1)/nthreads);
+
+    fn(0L, count/nthreads);
+
+    for (auto& thread: threads)
+        thread.join();
+}
+
+
+// lets the cereal archive read from mapped memory
+class MemoryStreamBuffer:public std::streambuf {
+public:
+    MemoryStreamBuffer(const char* data, uint64_t size)
+    {
+        char* p=const_cast<char*>(data);
+        setg(p, p, p+size);
+    }
+};
+
+
 CEREAL_CLASS_VERSION(Waveform::Frame, 1);
 
 template<typename Archive>
@@ -20,6 +188,7 @@ void Waveform::Frame::serialize(Archive& ar, uint32_t ver)
 
 CEREAL_CLASS_VERSION(Waveform, 1);
 
+// only used for project files from earlier versions, since waveforms are now stored in sections of their own
 template<typename Archive>
 void Waveform::load(Archive& ar, uint32_t ver)
 {
@@ -30,23 +199,13 @@ void Waveform::load(Archive& ar, uint32_t ver)
 
     ar(length, samplerate);
 
-    data=new float[length];
+    data=allocate(length);
     ar(cereal::binary_data(data, length*sizeof(float)));
 
     ar(frames);
 }
 
 
-template<typename Archive>
-void Waveform::save(Archive& ar, uint32_t ver) const
-{
-    ar(waveform_header_magic);
-    ar(length, samplerate);
-    ar(cereal::binary_data(data, length*sizeof(float)));
-    ar(frames);
-}
-
-
 CEREAL_CLASS_VERSION(Track::HermiteSplinePoint, 1);
 
 template<typename Archive>
@@ -68,7 +227,8 @@ void Track::Chunk::serialize(Archive& ar, uint32_t ver)
 }
 
 
-CEREAL_CLASS_VERSION(Track, 1);
+// version 2 leaves the waveform to sections of its own
+CEREAL_CLASS_VERSION(Track, 2);
 
 template<typename Archive>
 void Track::load(Archive& ar, uint32_t ver)
@@ -80,23 +240,27 @@ void Track::load(Archive& ar, uint32_t ver)
 
     ar(name, volume, panning, mute, solo, color);
 
-    ar(wave);
+    if (ver<2)
+        ar(wave);
 
-    firstchunk=lastchunk=new Chunk;
-    ar(*firstchunk);
+    Chunk* chunk=chunks.allocate(Chunk());
+    firstchunk=lastchunk=chunk->slot;
+    ar(*chunk);
 
     for (;;) {
         bool anotherchunk;
         ar(anotherchunk);
         if (!anotherchunk) break;
 
-        Chunk* chunk=new Chunk;
+        chunk=chunks.allocate(Chunk());
         chunk->prev=lastchunk;
-        lastchunk->next=chunk;
-        lastchunk=chunk;
+        chunks[lastchunk].next=chunk->slot;
+        lastchunk=chunk->slot;
 
         ar(*chunk);
     }
+
+    update_chunk_order();
 }
 
 
@@ -107,10 +271,18 @@ void Track::save(Archive& ar, uint32_t ver) const
 
     ar(name, volume, panning, mute, solo, color);
 
-    ar(wave);
+    for (const Chunk* chunk=get_first_chunk(); chunk; chunk=get_next_chunk(chunk))
+        ar(*chunk, chunk->next>=0);
+}
 
-    for (Chunk* chunk=firstchunk; chunk; chunk=chunk->next)
-        ar(*chunk, !!chunk->next);
+
+CEREAL_CLASS_VERSION(Track::Edit, 1);
+
+template<typename Archive>
+void Track::Edit::serialize(Archive& ar, uint32_t ver)
+{
+    ar(first, count);
+    ar(chunks);
 }
 
 
@@ -137,16 +309,631 @@ void Project::read(std::istream& is)
         throw std::runtime_error("Bad file format");
 
     ar(*this);
+}
+
+
+static std::shared_ptr<Waveform> map_samples(const std::shared_ptr<MappedFile>& file, const SectionEntry& section, std::vector<Waveform::Frame>&& frames)
+{
+    if (section.size<sizeof(SampleSectionHeader))
+        throw std::runtime_error("Bad file format");
+
+    const SampleSectionHeader* header=reinterpret_cast<const SampleSectionHeader*>(file->get_data() + section.offset);
+    const uint64_t available=(section.size-sizeof(SampleSectionHeader)) / sizeof(float);
+
+    if (header->length<0 || uint64_t(header->length)+2*Waveform::guard>available)
+        throw std::runtime_error("Bad file format");
 
-    for (auto& track: tracks)
-        track->compute_synth_frames();
+    const float* data=reinterpret_cast<const float*>(header+1) + Waveform::guard;
+
+    return std::make_shared<Waveform>(data, header->length, header->samplerate, std::move(frames), file);
 }
 
 
-void Project::write(std::ostream& os)
+// decodes the blocks of a compressed sample section straight from the mapped file
+class CompressedSampleDecoder:public Waveform::IBlockDecoder {
+public:
+    CompressedSampleDecoder(std::shared_ptr<MappedFile> file, const char* section, uint64_t size, long blocksize, const uint64_t* offsets):
+        file(std::move(file)),
+        section(section),
+        size(size),
+        blocksize(blocksize),
+        offsets(offsets)
+    {
+    }
+
+    virtual long get_block_length() const override
+    {
+        return blocksize;
+    }
+
+    virtual bool decode(float* out, long block, long count) const override
+    {
+        return decompress_block(out, count, reinterpret_cast<const uint8_t*>(section+offsets[block]), offsets[block+1]-offsets[block]);
+    }
+
+private:
+    std::shared_ptr<MappedFile> file;
+    const char*                 section;
+    uint64_t                    size;
+    long                        blocksize;
+    const uint64_t*             offsets;
+};
+
+
+/* Only the layout of the section is checked here, while the blocks are decoded in the background or when needed,
+ * so that opening a project does not have to wait for them. */
+static std::shared_ptr<Waveform> decompress_samples(const std::shared_ptr<MappedFile>& file, const SectionEntry& entry, std::vector<Waveform::Frame>&& frames)
 {
-    cereal::BinaryOutputArchive ar(os);
+    const char* section=file->get_data() + entry.offset;
+    const uint64_t size=entry.size;
+
+    if (size<sizeof(CompressedSampleSectionHeader))
+        throw std::runtime_error("Bad file format");
+
+    const CompressedSampleSectionHeader* header=reinterpret_cast<const CompressedSampleSectionHeader*>(section);
+    if (header->length<0 || header->blocksize<1 || header->blocksize>compression_block_size)
+        throw std::runtime_error("Bad file format");
+
+    const int64_t blockcount=(header->length + header->blocksize-1) / header->blocksize;
+    if (uint64_t(blockcount) >= (size-sizeof(CompressedSampleSectionHeader)) / sizeof(uint64_t))
+        throw std::runtime_error("Bad file format");
+
+    const uint64_t* offsets=reinterpret_cast<const uint64_t*>(header+1);
 
-    ar(file_header_magic);
+    for (int64_t i=0;i<blockcount;i++)
+        if (offsets[i]>offsets[i+1] || offsets[i+1]>size)
+            throw std::runtime_error("Bad file format");
+
+    auto wave=std::make_shared<Waveform>(
+        header->length,
+        header->samplerate,
+        std::move(frames),
+        std::make_unique<CompressedSampleDecoder>(file, section, size, header->blocksize, offsets));
+
+    wave->prefetch();
+
+    return wave;
+}
+
+
+static void compress_samples(std::ostream& os, const Waveform& wave)
+{
+    const Waveform::Samples samples=wave.get_samples();
+    const int64_t blockcount=(samples.size() + compression_block_size-1) / compression_block_size;
+
+    std::vector<std::vector<uint8_t>> blocks(blockcount);
+
+    parallel_for(blockcount, [&](long first, long last) {
+        for (long i=first;i<last;i++) {
+            const int64_t begin=i*compression_block_size;
+            compress_block(blocks[i], samples.begin()+begin, std::min<int64_t>(compression_block_size, samples.size()-begin));
+        }
+    });
+
+    CompressedSampleSectionHeader header={ samples.size(), wave.get_samplerate(), compression_block_size };
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    uint64_t offset=sizeof(header) + (blockcount+1)*sizeof(uint64_t);
+    for (const auto& block: blocks) {
+        os.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        offset+=block.size();
+    }
+
+    os.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+
+    for (const auto& block: blocks)
+        os.write(reinterpret_cast<const char*>(block.data()), block.size());
+}
+
+
+void Project::read(const char* filename)
+{
+    auto file=std::make_shared<MappedFile>(filename);
+    const char* base=file->get_data();
+
+    if (file->get_size()>=sizeof(uint32_t) && *reinterpret_cast<const uint32_t*>(base)==file_header_magic) {
+        std::ifstream ifs(filename, std::ios::binary);
+        read(ifs);
+        return;
+    }
+
+    if (file->get_size()<sizeof(ContainerHeader))
+        throw std::runtime_error("Bad file format");
+
+    const ContainerHeader* header=reinterpret_cast<const ContainerHeader*>(base);
+    if (header->magic!=container_magic)
+        throw std::runtime_error("Bad file format");
+    if (header->version>container_version)
+        throw std::runtime_error("Bad file version");
+
+    if (header->sectioncount > (file->get_size()-sizeof(ContainerHeader)) / sizeof(SectionEntry))
+        throw std::runtime_error("Bad file format");
+
+    const SectionEntry* sections=reinterpret_cast<const SectionEntry*>(header+1);
+
+    for (uint32_t i=0;i<header->sectioncount;i++)
+        if (sections[i].offset>file->get_size() || sections[i].size>file->get_size()-sections[i].offset)
+            throw std::runtime_error("Bad file format");
+
+    const SectionEntry* metadata=nullptr;
+    for (uint32_t i=0;i<header->sectioncount && !metadata;i++)
+        if (sections[i].type==uint32_t(SectionType::Metadata))
+            metadata=sections+i;
+
+    if (!metadata)
+        throw std::runtime_error("Bad file format");
+
+    MemoryStreamBuffer buffer(base+metadata->offset, metadata->size);
+    std::istream is(&buffer);
+    cereal::BinaryInputArchive ar(is);
     ar(*this);
+
+    std::vector<const SectionEntry*> samples(tracks.size(), nullptr), frames(tracks.size(), nullptr);
+
+    for (uint32_t i=0;i<header->sectioncount;i++) {
+        const SectionEntry& section=sections[i];
+        if (section.track>=tracks.size()) continue;
+
+        if (section.type==uint32_t(SectionType::Samples) || section.type==uint32_t(SectionType::CompressedSamples))
+            samples[section.track]=&section;
+        else if (section.type==uint32_t(SectionType::Frames))
+            frames[section.track]=&section;
+    }
+
+    for (size_t i=0;i<tracks.size();i++) {
+        if (!samples[i] || !frames[i] || frames[i]->size%sizeof(Waveform::Frame))
+            throw std::runtime_error("Bad file format");
+
+        const Waveform::Frame* framedata=reinterpret_cast<const Waveform::Frame*>(base+frames[i]->offset);
+        std::vector<Waveform::Frame> trackframes(framedata, framedata + frames[i]->size/sizeof(Waveform::Frame));
+
+        if (samples[i]->type==uint32_t(SectionType::Samples))
+            tracks[i]->set_waveform(map_samples(file, *samples[i], std::move(trackframes)));
+        else
+            tracks[i]->set_waveform(decompress_samples(file, *samples[i], std::move(trackframes)));
+    }
+
+    generation=header->generation;
+    if (generation)
+        read_journal(std::string(filename) + ".journal");
+}
+
+
+// appends a section at the next page boundary, filled in by the given function, and records it in the section table
+template<typename Fn>
+static void write_section(std::ostream& os, std::vector<SectionEntry>& sections, SectionType type, uint32_t track, Fn&& fill)
+{
+    static const char padding[section_alignment]={ 0 };
+
+    const uint64_t pos=os.tellp();
+    const uint64_t offset=(pos + section_alignment-1) / section_alignment * section_alignment;
+    os.write(padding, offset-pos);
+
+    fill(os);
+
+    sections.push_back({ uint32_t(type), track, offset, uint64_t(os.tellp())-offset });
+}
+
+
+Project::Snapshot Project::take_snapshot()
+{
+    Snapshot snapshot;
+
+    std::ostringstream os;
+    {
+        cereal::BinaryOutputArchive ar(os);
+        ar(*this);
+    }
+
+    snapshot.metadata=os.str();
+
+    for (const auto& track: tracks)
+        snapshot.waves.push_back(track->get_shared_waveform());
+
+    // a new file needs a new journal, which the one of any file it replaces must not be mistaken for
+    std::random_device random;
+    do {
+        snapshot.generation=random();
+    } while (!snapshot.generation || snapshot.generation==generation);
+
+    snapshot.editcount=edits.size();
+
+    return snapshot;
+}
+
+
+void Project::write(const char* filename, SampleEncoding encoding)
+{
+    take_snapshot().write(filename, encoding);
+}
+
+
+// flushes a file or directory to disk, returning false on failure
+static bool sync_path(const char* path, int flags)
+{
+    int fd=open(path, flags);
+    if (fd<0) return false;
+
+    const bool synced=fsync(fd)==0;
+    close(fd);
+
+    return synced;
+}
+
+
+// makes the creation or renaming of a file durable, which is not worth failing a save over
+static void sync_directory(const char* filename)
+{
+    std::string directory(filename);
+    const size_t slash=directory.rfind('/');
+    directory=slash==std::string::npos ? "." : slash==0 ? "/" : directory.substr(0, slash);
+
+    sync_path(directory.c_str(), O_RDONLY|O_DIRECTORY);
+}
+
+
+void Project::Snapshot::write(const char* filename, SampleEncoding encoding) const
+{
+    // the silence in place of corrupt sample data must not replace the original data in the file
+    for (const auto& wave: waves)
+        wave->fetch(0, wave->get_length(), true);
+
+    // the file being replaced may still be mapped by this or another project, so a new file is written instead
+    const std::string tmpfilename=std::string(filename) + ".tmp";
+
+    std::ofstream os(tmpfilename, std::ios::binary);
+    if (!os)
+        throw std::runtime_error(tmpfilename + ": " + strerror(errno));
+
+    ContainerHeader header={ container_magic, container_version, uint32_t(1 + 2*waves.size()), generation };
+    std::vector<SectionEntry> sections;
+
+    // the section table is filled in once all sections have been written
+    const SectionEntry placeholder={};
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (uint32_t i=0;i<header.sectioncount;i++)
+        os.write(reinterpret_cast<const char*>(&placeholder), sizeof(placeholder));
+
+    write_section(os, sections, SectionType::Metadata, 0, [this](std::ostream& os) {
+        os.write(metadata.data(), metadata.size());
+    });
+
+    for (uint32_t i=0;i<waves.size();i++) {
+        const Waveform& wave=*waves[i];
+
+        if (encoding==SampleEncoding::Compressed)
+            write_section(os, sections, SectionType::CompressedSamples, i, [&wave](std::ostream& os) {
+                compress_samples(os, wave);
+            });
+        else
+            write_section(os, sections, SectionType::Samples, i, [&wave](std::ostream& os) {
+                SampleSectionHeader sampleheader={ wave.get_length(), wave.get_samplerate(), {} };
+                os.write(reinterpret_cast<const char*>(&sampleheader), sizeof(sampleheader));
+
+                const Waveform::Samples samples=wave.get_samples();
+                os.write(reinterpret_cast<const char*>(samples.begin()-Waveform::guard), (samples.size() + 2*Waveform::guard) * sizeof(float));
+            });
+
+        write_section(os, sections, SectionType::Frames, i, [&wave](std::ostream& os) {
+            if (wave.get_frame_count()>0)
+                os.write(reinterpret_cast<const char*>(&wave.get_frame(0)), wave.get_frame_count() * sizeof(Waveform::Frame));
+        });
+    }
+
+    os.seekp(sizeof(header));
+    os.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(SectionEntry));
+
+    os.close();
+
+    // the new file has to be on disk before it replaces the old one, lest a crash leave neither
+    if (!os || !sync_path(tmpfilename.c_str(), O_RDONLY)) {
+        remove(tmpfilename.c_str());
+        throw std::runtime_error(tmpfilename + ": write error");
+    }
+
+    if (rename(tmpfilename.c_str(), filename)!=0) {
+        const std::string error=strerror(errno);
+        remove(tmpfilename.c_str());
+        throw std::runtime_error(std::string(filename) + ": " + error);
+    }
+
+    sync_directory(filename);
+
+    // belongs to the file just replaced
+    remove((std::string(filename) + ".journal").c_str());
+}
+
+
+// FNV-1a, which is plenty to tell a record cut off by a crash
+static uint32_t checksum(const char* data, size_t size)
+{
+    uint32_t hash=2166136261u;
+
+    for (size_t i=0;i<size;i++)
+        hash=(hash ^ uint8_t(data[i])) * 16777619u;
+
+    return hash;
+}
+
+
+// appends a record filled in by the given function
+template<typename Fn>
+static void append_journal_record(std::string& records, Fn&& fill)
+{
+    std::ostringstream os;
+    {
+        cereal::BinaryOutputArchive ar(os);
+        fill(ar);
+    }
+
+    const std::string payload=os.str();
+    const JournalRecordHeader header={ uint32_t(payload.size()), checksum(payload.data(), payload.size()) };
+
+    records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    records.append(payload);
+}
+
+
+void Project::record_edit(uint32_t track, Track::Edit&& chunks)
+{
+    Edit edit;
+    edit.type=Edit::Type::Chunks;
+    edit.track=track;
+    edit.chunks=std::move(chunks);
+
+    edits.push_back(std::move(edit));
+}
+
+
+void Project::record_settings()
+{
+    Edit edit;
+    edit.type=Edit::Type::Settings;
+    edit.bpm=bpm;
+    edit.beat_subdivisions=beat_subdivisions;
+
+    edits.push_back(std::move(edit));
+}
+
+
+// whether the edits apply one after the other, leaving at least one chunk in each track
+bool Project::can_apply(const std::vector<Edit>& edits) const
+{
+    std::vector<int> chunkcounts;
+    for (const auto& track: tracks)
+        chunkcounts.push_back(track->get_chunk_count());
+
+    for (const Edit& edit: edits) {
+        if (edit.type!=Edit::Type::Chunks)
+            continue;
+
+        if (edit.track>=chunkcounts.size())
+            return false;
+
+        int& chunkcount=chunkcounts[edit.track];
+
+        if (edit.chunks.first<0 || edit.chunks.count<0 || edit.chunks.first+edit.chunks.count>chunkcount)
+            return false;
+
+        chunkcount+=int(edit.chunks.chunks.size()) - edit.chunks.count;
+        if (chunkcount<=0)
+            return false;
+    }
+
+    return true;
+}
+
+
+void Project::apply_edit(const Edit& edit)
+{
+    switch (edit.type) {
+    case Edit::Type::Chunks:
+        if (edit.track>=tracks.size())
+            throw std::runtime_error("Bad journal");
+
+        tracks[edit.track]->apply_edit(edit.chunks);
+        break;
+    case Edit::Type::Settings:
+        bpm=edit.bpm;
+        beat_subdivisions=edit.beat_subdivisions;
+        break;
+    }
+}
+
+
+void Project::read_journal(const std::string& filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    const std::string journal{ std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() };
+
+    // a missing journal, or one left behind by an earlier version of the file, is simply replaced on the next save
+    if (journal.size()<sizeof(JournalHeader))
+        return;
+
+    JournalHeader header;
+    memcpy(&header, journal.data(), sizeof(header));
+
+    if (header.magic!=journal_magic || header.generation!=generation)
+        return;
+    if (header.version>journal_version)
+        throw std::runtime_error("Bad file version");
+
+    uint64_t pos=sizeof(JournalHeader);
+    savedsize=unsavedsize=pos;
+
+    while (journal.size()-pos>=sizeof(JournalRecordHeader)) {
+        JournalRecordHeader recordheader;
+        memcpy(&recordheader, journal.data()+pos, sizeof(recordheader));
+
+        const char* payload=journal.data() + pos + sizeof(recordheader);
+        if (recordheader.size>journal.size()-pos-sizeof(recordheader) || checksum(payload, recordheader.size)!=recordheader.checksum)
+            break;
+
+        pos+=sizeof(recordheader) + recordheader.size;
+
+        MemoryStreamBuffer buffer(payload, recordheader.size);
+        std::istream is(&buffer);
+        cereal::BinaryInputArchive ar(is);
+
+        // records may pass their checksums and still not apply, such as when written by another version
+        uint8_t type;
+        Edit    edit;
+
+        try {
+            ar(type);
+
+            edit.type=Edit::Type(type);
+
+            if (edit.type==Edit::Type::Chunks)
+                ar(edit.track, edit.chunks);
+            else if (edit.type==Edit::Type::Settings)
+                ar(edit.bpm, edit.beat_subdivisions);
+            else if (type!=journal_save_record)
+                break;
+        }
+        catch (std::exception&) {
+            break;
+        }
+
+        if (type==journal_save_record) {
+            if (!can_apply(unsaved))
+                break;
+
+            for (const Edit& edit: unsaved)
+                apply_edit(edit);
+
+            unsaved.clear();
+            savedsize=pos;
+        }
+        else
+            unsaved.push_back(std::move(edit));
+
+        unsavedsize=pos;
+    }
+
+    /* Replaying stops at the first record which is unknown or does not apply, as it does at a truncated record.
+     * The edits since the last save are only kept for recovery if they all apply. */
+    if (!can_apply(unsaved)) {
+        unsaved.clear();
+        unsavedsize=savedsize;
+    }
+
+    journalsize=savedsize;
+}
+
+
+void Project::recover_unsaved_edits()
+{
+    for (const Edit& edit: unsaved)
+        apply_edit(edit);
+
+    unsaved.clear();
+    journalsize=unsavedsize;
+}
+
+
+void Project::discard_unsaved_edits(const char* filename)
+{
+    unsaved.clear();
+    if (!generation) return;
+
+    const std::string journalname=std::string(filename) + ".journal";
+
+    if (savedsize>0)
+        truncate(journalname.c_str(), savedsize);
+    else
+        remove(journalname.c_str());
+
+    journalsize=savedsize;
+}
+
+
+bool Project::journal_needs_compaction() const
+{
+    return journalsize>journal_compaction_size;
+}
+
+
+Project::JournalUpdate Project::take_journal_update(bool save)
+{
+    JournalUpdate update;
+    update.generation=generation;
+    update.offset=journalsize;
+    update.editcount=edits.size();
+    update.save=save;
+
+    if (!journalsize) {
+        const JournalHeader header={ journal_magic, journal_version, generation, 0 };
+        update.records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    for (const Edit& edit: edits)
+        append_journal_record(update.records, [&edit](cereal::BinaryOutputArchive& ar) {
+            ar(uint8_t(edit.type));
+
+            if (edit.type==Edit::Type::Chunks)
+                ar(edit.track, edit.chunks);
+            else
+                ar(edit.bpm, edit.beat_subdivisions);
+        });
+
+    if (save)
+        append_journal_record(update.records, [](cereal::BinaryOutputArchive& ar) {
+            ar(journal_save_record);
+        });
+
+    return update;
+}
+
+
+void Project::JournalUpdate::append(const char* filename) const
+{
+    const std::string journalname=std::string(filename) + ".journal";
+
+    int fd=open(journalname.c_str(), O_RDWR|O_CREAT, 0666);
+    if (fd<0)
+        throw std::runtime_error(journalname + ": " + strerror(errno));
+
+    // an existing journal has to belong to the project file, and anything after the offset is dropped
+    JournalHeader header;
+    bool ok=offset==0 || (pread(fd, &header, sizeof(header), 0)==sizeof(header) && header.magic==journal_magic && header.generation==generation);
+    ok=ok && ftruncate(fd, offset)==0;
+
+    for (size_t done=0;ok && done<records.size();) {
+        const ssize_t n=pwrite(fd, records.data()+done, records.size()-done, offset+done);
+        if (n>0)
+            done+=n;
+        else
+            ok=false;
+    }
+
+    ok=ok && fsync(fd)==0;
+    close(fd);
+
+    if (!ok)
+        throw std::runtime_error(journalname + ": write error");
+
+    if (offset==0)
+        sync_directory(journalname.c_str());
+}
+
+
+void Project::commit(const Snapshot& snapshot)
+{
+    edits.erase(edits.begin(), edits.begin()+snapshot.editcount);
+
+    generation=snapshot.generation;
+    journalsize=savedsize=0;
+    unsaved.clear();
+}
+
+
+void Project::commit(const JournalUpdate& update)
+{
+    edits.erase(edits.begin(), edits.begin()+update.editcount);
+
+    journalsize=update.offset + update.records.size();
+    if (update.save)
+        savedsize=journalsize;
 }
@@ -1,5 +1,9 @@
 #include <memory>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
 #include <stdio.h>
 #include <sndfile.h>
 #include "track.h"
@@ -50,20 +54,205 @@ Track::HermiteInterpolation::HermiteInterpolation(const HermiteSplinePoint& p0,
 }
 
 
+Track::PitchContourSpline::PitchContourSpline(PitchContourIterator pci)
+{
+    begin=pci->t;
+
+    for (;;) {
+        auto next=pci+1;
+        if (!next) break;
+
+        segments.emplace_back(*pci, *next);
+        knots.push_back(next->t);
+
+        pci=next;
+    }
+
+    segments.emplace_back(pci->y);
+
+    end=pci->t;
+}
+
+
+float Track::PitchContourSpline::operator()(double t) const
+{
+    const int segment=std::upper_bound(knots.begin(), knots.end(), t) - knots.begin();
+    return segments[segment](t);
+}
+
+
+void Track::PitchContourSpline::evaluate(float* out, const double* t, int n) const
+{
+    int segment=0;
+
+    for (int i=0;i<n;i++)
+        out[i]=(*this)(t[i], segment);
+}
+
+
+/* Period length in samples for a MIDI pitch, i.e. samplerate / (440 * 2^((pitch-69)/12)), from a table of the
+ * periods of all whole semitones and a short series for the fraction of a semitone above, which saves calling expf
+ * for every period synthesized and is accurate to about 1e-8. */
+class PeriodTable {
+    double  periods[128];   // at a sample rate of 1
+
+public:
+    PeriodTable()
+    {
+        for (int i=0;i<128;i++)
+            periods[i]=1.0 / (440.0 * exp2((i-69) / 12.0));
+    }
+
+    double operator()(float pitch, int samplerate) const
+    {
+        if (!(pitch>=0.0f && pitch<128.0f))
+            return samplerate / (440.0 * exp2((pitch-69.0) / 12.0));
+
+        const int semitone=(int) pitch;
+
+        // 2^(-x/12) for the fraction x of a semitone, as exp(u) with u=-x*ln(2)/12, which is small
+        const double u=(semitone - pitch) * (M_LN2/12);
+
+        return samplerate * periods[semitone] * (1.0 + u*(1.0 + u/2*(1.0 + u/3*(1.0 + u/4))));
+    }
+};
+
+static const PeriodTable pitch_to_period;
+
+
+Track::Chunk* Track::ChunkTable::allocate(const Chunk& init)
+{
+    int slot;
+
+    if (!freeslots.empty()) {
+        slot=freeslots.back();
+        freeslots.pop_back();
+    }
+    else {
+        slot=count++;
+        if ((slot>>blockbits)==int(blocks.size()))
+            blocks.push_back(std::make_unique<Chunk[]>(blocksize));
+    }
+
+    Chunk& chunk=(*this)[slot];
+    chunk=init;
+    chunk.slot=slot;
+
+    return &chunk;
+}
+
+
+void Track::ChunkTable::release(Chunk* chunk)
+{
+    assert(&(*this)[chunk->slot]==chunk);
+
+    freeslots.push_back(chunk->slot);
+
+    *chunk=Chunk();
+}
+
+
 Track::Track(std::shared_ptr<Waveform> wave):wave(wave)
 {
     name="unnamed track";
 }
 
 
-Track::~Track()
+Track::Chunk* Track::find_chunk(double t)
 {
-    while (firstchunk) {
-        Chunk* tmp=firstchunk;
-        firstchunk=tmp->next;
+    auto it=std::upper_bound(
+        chunkorder.begin(),
+        chunkorder.end(),
+        t,
+        [this] (double t, int slot) {
+            return t < chunks[slot].begin;
+        }
+    );
+
+    if (it==chunkorder.begin()) return nullptr;
+
+    Chunk* chunk=&chunks[*--it];
+    return t<chunk->end ? chunk : nullptr;
+}
+
 
-        delete tmp;
+void Track::update_chunk_order()
+{
+    chunkorder.clear();
+
+    for (Chunk* chunk=get_first_chunk(); chunk; chunk=get_next_chunk(chunk))
+        chunkorder.push_back(chunk->slot);
+}
+
+
+int Track::get_chunk_position(const Chunk* chunk) const
+{
+    auto it=std::lower_bound(
+        chunkorder.begin(),
+        chunkorder.end(),
+        chunk->begin,
+        [this] (int slot, double t) {
+            return chunks[slot].begin < t;
+        }
+    );
+
+    assert(it!=chunkorder.end() && *it==chunk->slot);
+    return it - chunkorder.begin();
+}
+
+
+Track::Edit Track::make_edit(const Chunk* first, const Chunk* last, int count) const
+{
+    Edit edit;
+    edit.first=get_chunk_position(first);
+    edit.count=count;
+
+    for (const Chunk* chunk=first;;chunk=get_next_chunk(chunk)) {
+        edit.chunks.push_back(*chunk);
+        if (chunk==last) break;
+    }
+
+    return edit;
+}
+
+
+void Track::apply_edit(const Edit& edit)
+{
+    if (edit.first<0 || edit.count<0 || edit.first+edit.count>get_chunk_count())
+        throw std::runtime_error("Bad journal");
+
+    const int prev=edit.first>0 ? chunkorder[edit.first-1] : -1;
+    const int next=edit.first+edit.count<get_chunk_count() ? chunkorder[edit.first+edit.count] : -1;
+
+    for (int i=0;i<edit.count;i++)
+        chunks.release(&chunks[chunkorder[edit.first+i]]);
+
+    int last=prev;
+
+    for (const Chunk& init: edit.chunks) {
+        Chunk* chunk=chunks.allocate(init);
+        chunk->prev=last;
+        chunk->backup=-1;
+
+        if (last>=0)
+            chunks[last].next=chunk->slot;
+        else
+            firstchunk=chunk->slot;
+
+        last=chunk->slot;
     }
+
+    if (last>=0)
+        chunks[last].next=next;
+    else
+        firstchunk=next;
+
+    if (next>=0)
+        chunks[next].prev=last;
+    else
+        lastchunk=last;
+
+    update_chunk_order();
 }
 
 
@@ -156,7 +345,7 @@ void Track::detect_chunks()
 
     static const char* notenames[]={ "C", "C#", "D", "Eb", "E", "F", "F#", "G", "G#", "A", "Bb", "B" };
 
-    assert(!firstchunk && !lastchunk);
+    assert(firstchunk<0 && lastchunk<0);
 
     while (i>=0) {
         int begin=i;
@@ -165,8 +354,7 @@ void Track::detect_chunks()
         while (begin>=0 && nodes(begin, j).pitch==pitch)
             j=nodes(begin--, j).back;
         
-        Chunk* tmp=new Chunk;
-        tmp->prev  =tmp->next=nullptr;
+        Chunk* tmp=chunks.allocate(Chunk());
         
         tmp->beginframe=begin+1;
         tmp->endframe  =i+1;
@@ -178,40 +366,45 @@ void Track::detect_chunks()
         tmp->voiced=pitch>=0;
         tmp->elastic=tmp->voiced;
 
-        if (firstchunk) {
-            firstchunk->prev=tmp;
-            tmp       ->next=firstchunk;
+        if (firstchunk>=0) {
+            chunks[firstchunk].prev=tmp->slot;
+            tmp->next=firstchunk;
         }
         else
-            lastchunk=tmp;
+            lastchunk=tmp->slot;
 
-        firstchunk=tmp;
+        firstchunk=tmp->slot;
 
         i=begin;
     }
 
-    for (auto* ch=firstchunk; ch; ch=ch->next)
+    for (auto* ch=get_first_chunk(); ch; ch=get_next_chunk(ch))
         if (!ch->voiced) {
-            if (ch->prev && ch->next)
-                ch->pitch=(ch->prev->pitch+ch->next->pitch) / 2;
-            else if (ch->prev)
-                ch->pitch=ch->prev->pitch;
-            else if (ch->next)
-                ch->pitch=ch->next->pitch;
+            const Chunk* prev=get_prev_chunk(ch);
+            const Chunk* next=get_next_chunk(ch);
+
+            if (prev && next)
+                ch->pitch=(prev->pitch+next->pitch) / 2;
+            else if (prev)
+                ch->pitch=prev->pitch;
+            else if (next)
+                ch->pitch=next->pitch;
             else
                 ch->pitch=60;
         }
+
+    update_chunk_order();
 }
 
 
 void Track::compute_pitch_contour()
 {
-    for (Chunk* ch=firstchunk; ch; ch=ch->next) {
+    for (Chunk* ch=get_first_chunk(); ch; ch=get_next_chunk(ch)) {
         if (!ch->voiced) continue;
 
         Chunk* from=ch;
-        while (ch->next && ch->next->voiced)
-            ch=ch->next;
+        while (get_next_chunk(ch) && get_next_chunk(ch)->voiced)
+            ch=get_next_chunk(ch);
 
         compute_pitch_contour(from, from->beginframe, ch->endframe);
     }
@@ -345,8 +538,8 @@ void Track::compute_pitch_contour(Chunk* chunk, int from, int to)
 
 
     for (Node* node=first; node;) {
-        while (chunk->next && chunk->next->voiced && node->pt.t>=wave->get_frame(chunk->next->beginframe).position)
-            chunk=chunk->next;
+        while (get_next_chunk(chunk) && get_next_chunk(chunk)->voiced && node->pt.t>=wave->get_frame(get_next_chunk(chunk)->beginframe).position)
+            chunk=get_next_chunk(chunk);
         
         chunk->pitchcontour.push_back(node->pt);
 
@@ -359,114 +552,296 @@ void Track::compute_pitch_contour(Chunk* chunk, int from, int to)
 
 void Track::compute_synth_frames()
 {
-    double curpos=0.0;
+    // synth frames of each voiced run and each unvoiced chunk are independent of all others
+    std::vector<Chunk*> runs;
 
-    synth.clear();
+    for (Chunk* chunk=get_first_chunk(); chunk; chunk=get_next_chunk(chunk)) {
+        runs.push_back(chunk);
 
-    for (Chunk* chunk=firstchunk; chunk; chunk=chunk->next) {
-        if (chunk->voiced) {
-            // Pitch-Synchronous Overlap-Add
-            double t=chunk->begin;
-
-            PitchContourIterator pci(chunk, 0);
+        while (chunk->voiced && get_next_chunk(chunk) && get_next_chunk(chunk)->voiced)
+            chunk=get_next_chunk(chunk);
+    }
 
-            for (;;) {
-                while (pci+1 && t>=(pci+1)->t) pci=pci+1;
+    // distribute contiguous groups of runs across threads, unless there are too few runs to be worthwhile
+    const int nthreads=std::clamp<int>(runs.size()/64, 1, std::max(std::thread::hardware_concurrency(), 1u));
 
-                while (t>=chunk->end) {
-                    if (!chunk->next || !chunk->next->voiced) goto end;
-                    chunk=chunk->next;
-                }
+    std::vector<std::shared_ptr<const SynthFrames::Run>> frames(runs.size());
+    std::vector<std::thread> threads;
 
-                double s=(t-chunk->begin) / (chunk->end-chunk->begin);
-                
-                HermiteInterpolation hi;
-                if (pci+1)
-                    hi=HermiteInterpolation(*pci, *(pci+1));
-                else
-                    hi=HermiteInterpolation(pci->y);
-                
-                double nextperiod=get_samplerate() / (expf((hi(t) - 69.0f) * M_LN2 / 12) * 440.0f);
-
-                /* Pitch shifting and time stretching will cause input and output frame centers to become disaligned,
-                 * so generally, our current position will be somewhere inbetween two input frame markers, hence we
-                 * linearly interpolate between between those two frames, except at the end of a sequence of voiced
-                 * chunks where we linearly fade out of the preceding frame. Note that an unvoiced chunk will start
-                 * with an output frame immediately at the beginning of the chunk, so otherwise we might end up with
-                 * two almost fully overlapping frames in the worst case, inadvertently increasing its volume. */
-
-                SynthFrame sf;
-
-                double srcframe=lerp((double) chunk->beginframe, (double) chunk->endframe, s);
-                int frame=(int) floor(srcframe);
-                double u=srcframe - frame;
-
-                sf.smid  =wave->get_frame(frame).position;
-                sf.tbegin=t + wave->get_frame(frame-1).position - sf.smid;
-                sf.tmid  =t;
-                sf.tend  =t + wave->get_frame(frame+1).position - sf.smid;
-
-                sf.stretch=1.0f;
-                sf.amplitude=float(1.0-u);
-                synth.push_back(sf);
-
-                if (frame+1<chunk->endframe || (chunk->next && chunk->next->voiced)) {
-                    sf.smid  =wave->get_frame(frame+1).position;
-                    sf.tbegin=t + wave->get_frame(frame  ).position - sf.smid;
-                    sf.tmid  =t;
-                    sf.tend  =t + wave->get_frame(frame+2).position - sf.smid;
-
-                    sf.stretch=1.0f;
-                    sf.amplitude=float(u);
-                    synth.push_back(sf);
-                }
+    for (int i=0;i<nthreads;i++) {
+        auto job=[this, &runs, &frames, i, nthreads]() {
+            const int first=runs.size() * i     / nthreads;
+            const int last =runs.size() * (i+1) / nthreads;
 
-                t+=nextperiod;
+            for (int j=first;j<last;j++) {
+                auto run=std::make_shared<SynthFrames::Run>();
+                compute_synth_frames(*run, runs[j]);
+                frames[j]=std::move(run);
             }
+        };
+
+        if (i<nthreads-1)
+            threads.emplace_back(job);
+        else
+            job();
+    }
+
+    for (auto& thread: threads)
+        thread.join();
+
+    std::atomic_store(&synth, std::make_shared<const SynthFrames>(std::move(frames), get_first_chunk()->begin, get_last_chunk()->end));
+}
+
+
+// synthesis of a voiced run proceeds continuously from its beginning, so ranges of chunks are extended to entire runs
+void Track::extend_to_runs(Chunk*& first, Chunk*& last)
+{
+    while (first->voiced && get_prev_chunk(first) && get_prev_chunk(first)->voiced)
+        first=get_prev_chunk(first);
+
+    while (last->voiced && get_next_chunk(last) && get_next_chunk(last)->voiced)
+        last=get_next_chunk(last);
+}
+
+
+std::pair<double, double> Track::compute_synth_frames(std::vector<SynthFrame>& frames, Chunk* first, Chunk* last)
+{
+    extend_to_runs(first, last);
+
+    for (Chunk* chunk=first;; chunk=get_next_chunk(chunk)) {
+        chunk=compute_synth_frames(frames, chunk);
+        if (chunk==last) break;
+    }
+
+    return { first->begin, last->end };
+}
+
+
+std::pair<double, double> Track::compute_synth_frames(Chunk* first, Chunk* last)
+{
+    // nothing to update before the frames are first computed in full
+    if (!synth)
+        return { first->begin, last->end };
+
+    /* Edits which join or separate runs of voiced chunks leave previous runs extending beyond the runs of the
+     * edited chunks, and runs are replaced as a whole, so the range is widened until it covers both. */
+    for (;;) {
+        extend_to_runs(first, last);
+
+        const auto [runbegin, runend]=synth->get_run_span(first->begin, last->end);
+
+        Chunk *newfirst=first, *newlast=last;
+        while (newfirst->begin>runbegin && get_prev_chunk(newfirst))
+            newfirst=get_prev_chunk(newfirst);
+        while (newlast->end<=runend && get_next_chunk(newlast))
+            newlast=get_next_chunk(newlast);
+
+        if (newfirst==first && newlast==last) break;
+
+        first=newfirst;
+        last =newlast;
+    }
+
+    std::vector<std::shared_ptr<const SynthFrames::Run>> runs;
+
+    for (Chunk* chunk=first;; chunk=get_next_chunk(chunk)) {
+        auto run=std::make_shared<SynthFrames::Run>();
+        chunk=compute_synth_frames(*run, chunk);
+        runs.push_back(std::move(run));
 
-            end:;
+        if (chunk==last) break;
+    }
+
+    /* Edits never change the overall time span of the chunks they modify, and all synth frames generated
+     * from a range of chunks are centered within the time span of this range, so we can locate and replace
+     * the previous frames of this range by their center positions. */
+    const double rangebegin=first->begin, rangeend=last->end;
+
+    // the grains of both the previous and the new frames may extend beyond the time span of the chunks
+    double begin=rangebegin, end=rangeend;
+
+    for (auto it=synth->cursor(synth->find(rangebegin)), to=synth->cursor(synth->find(rangeend)); it!=to; ++it) {
+        begin=std::min(begin, it->tbegin());
+        end  =std::max(end,   it->tend());
+    }
+
+    for (const auto& run: runs)
+        for (const auto& sf: *run) {
+            begin=std::min(begin, sf.tbegin());
+            end  =std::max(end,   sf.tend());
         }
-        else {
-            // simple Overlap-Add
-            for (int i=chunk->beginframe;i<chunk->endframe;i++) {
-                double s0=i>0 ?
-                    unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i-1).position) :
-                    0.0;
-
-                double s1=
-                    unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i  ).position);
-
-                double s2=i+1 < wave->get_frame_count() ?
-                    unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i+1).position) :
-                    1.0;
-
-                SynthFrame sf;
-
-                sf.smid=wave->get_frame(i).position;
-                sf.tbegin=lerp(chunk->begin, chunk->end, s0);
-                sf.tmid  =lerp(chunk->begin, chunk->end, s1);
-                sf.tend  =lerp(chunk->begin, chunk->end, s2);
-
-                sf.stretch=1.0f;
-                sf.amplitude=1.0f;
-                
-                synth.push_back(sf);
+
+    // publish a new version, since the previous one may still be in use
+    std::atomic_store(&synth, std::make_shared<const SynthFrames>(*synth, rangebegin, rangeend, std::move(runs)));
+
+    return { begin, end };
+}
+
+
+// Appends the synth frames for the given chunk to the given list, or for the entire run of voiced chunks starting
+// with the given chunk, and returns the last chunk processed.
+Track::Chunk* Track::compute_synth_frames(std::vector<SynthFrame>& frames, Chunk* chunk)
+{
+    if (chunk->voiced) {
+        // Pitch-Synchronous Overlap-Add
+        double t=chunk->begin;
+
+        const PitchContourSpline contour(PitchContourIterator(*this, chunk, 0));
+        int segment=0;
+
+        for (;;) {
+            while (t>=chunk->end) {
+                if (!get_next_chunk(chunk) || !get_next_chunk(chunk)->voiced) return chunk;
+                chunk=get_next_chunk(chunk);
+            }
+
+            double s=(t-chunk->begin) / (chunk->end-chunk->begin);
+            
+            double nextperiod=pitch_to_period(contour(t, segment), get_samplerate());
+
+            /* Pitch shifting and time stretching will cause input and output frame centers to become disaligned,
+             * so generally, our current position will be somewhere inbetween two input frame markers, hence we
+             * linearly interpolate between between those two frames, except at the end of a sequence of voiced
+             * chunks where we linearly fade out of the preceding frame. Note that an unvoiced chunk will start
+             * with an output frame immediately at the beginning of the chunk, so otherwise we might end up with
+             * two almost fully overlapping frames in the worst case, inadvertently increasing its volume. */
+
+            SynthFrame sf;
+
+            double srcframe=lerp((double) chunk->beginframe, (double) chunk->endframe, s);
+            int frame=(int) floor(srcframe);
+            double u=srcframe - frame;
+
+            double smid=wave->get_frame(frame).position;
+
+            sf.tmid   =t;
+            sf.soffset=float(smid - t);
+            sf.left   =float(smid - wave->get_frame(frame-1).position);
+            sf.right  =float(wave->get_frame(frame+1).position - smid);
+
+            sf.amplitude=float(1.0-u);
+            frames.push_back(sf);
+
+            if (frame+1<chunk->endframe || (get_next_chunk(chunk) && get_next_chunk(chunk)->voiced)) {
+                smid=wave->get_frame(frame+1).position;
+
+                sf.tmid   =t;
+                sf.soffset=float(smid - t);
+                sf.left   =float(smid - wave->get_frame(frame  ).position);
+                sf.right  =float(wave->get_frame(frame+2).position - smid);
+
+                sf.amplitude=float(u);
+                frames.push_back(sf);
             }
+
+            t+=nextperiod;
+        }
+    }
+    else {
+        // simple Overlap-Add
+        for (int i=chunk->beginframe;i<chunk->endframe;i++) {
+            double s0=i>0 ?
+                unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i-1).position) :
+                0.0;
+
+            double s1=
+                unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i  ).position);
+
+            double s2=i+1 < wave->get_frame_count() ?
+                unlerp(wave->get_frame(chunk->beginframe).position, wave->get_frame(chunk->endframe).position, wave->get_frame(i+1).position) :
+                1.0;
+
+            SynthFrame sf;
+
+            sf.tmid   =lerp(chunk->begin, chunk->end, s1);
+            sf.soffset=float(wave->get_frame(i).position - sf.tmid);
+            sf.left   =float(sf.tmid - lerp(chunk->begin, chunk->end, s0));
+            sf.right  =float(lerp(chunk->begin, chunk->end, s2) - sf.tmid);
+
+            sf.amplitude=1.0f;
+            
+            frames.push_back(sf);
         }
     }
+
+    return chunk;
 }
 
 
-int Track::get_first_synth_frame_index(const Track::Chunk* chunk) const
+Track::SynthFrames::SynthFrames(std::vector<std::shared_ptr<const Run>>&& runs, double begin, double end):begin(begin), end(end)
 {
-    return std::lower_bound(
-        synth.begin(),
-        synth.end(),
-        chunk->begin,
-        [] (const SynthFrame& sf, long ptr) {
-            return sf.tmid < ptr;
-        }
-    ) - synth.begin();
+    for (auto& run: runs)
+        append(std::move(run));
+}
+
+
+Track::SynthFrames::SynthFrames(const SynthFrames& other, double rangebegin, double rangeend, std::vector<std::shared_ptr<const Run>>&& newruns):
+    begin(other.begin),
+    end(other.end)
+{
+    auto by_tmid=[] (const Entry& entry, double t) {
+        return entry.run->front().tmid < t;
+    };
+
+    auto from=std::lower_bound(other.runs.begin(), other.runs.end(), rangebegin, by_tmid);
+    auto to  =std::lower_bound(from,               other.runs.end(), rangeend,   by_tmid);
+
+    runs.reserve(other.runs.size() - (to-from) + newruns.size());
+
+    for (auto it=other.runs.begin(); it!=from; it++)
+        append(it->run);
+
+    for (auto& run: newruns)
+        append(std::move(run));
+
+    for (auto it=to; it!=other.runs.end(); it++)
+        append(it->run);
+}
+
+
+void Track::SynthFrames::append(std::shared_ptr<const Run> run)
+{
+    if (run->empty()) return;
+
+    const int size=run->size();
+
+    runs.push_back({ std::move(run), count });
+    count+=size;
+}
+
+
+int Track::SynthFrames::find(double t) const
+{
+    auto by_tmid=[] (const SynthFrame& sf, double t) {
+        return sf.tmid < t;
+    };
+
+    // the first run not entirely centered before t
+    auto it=std::lower_bound(runs.begin(), runs.end(), t, [] (const Entry& entry, double t) {
+        return entry.run->back().tmid < t;
+    });
+
+    if (it==runs.end())
+        return count;
+
+    return it->first + (std::lower_bound(it->run->begin(), it->run->end(), t, by_tmid) - it->run->begin());
+}
+
+
+std::pair<double, double> Track::SynthFrames::get_run_span(double begin, double end) const
+{
+    double runbegin=HUGE_VAL, runend=-HUGE_VAL;
+
+    auto it=std::lower_bound(runs.begin(), runs.end(), begin, [] (const Entry& entry, double t) {
+        return entry.run->back().tmid < t;
+    });
+
+    for (; it!=runs.end() && it->run->front().tmid<end; it++) {
+        runbegin=std::min(runbegin, it->run->front().tmid);
+        runend  =std::max(runend,   it->run->back ().tmid);
+    }
+
+    return { runbegin, runend };
 }
 
 
@@ -522,37 +897,140 @@ void Track::update_akima_slope(const HermiteSplinePoint* p0, HermiteSplinePoint*
 }
 
 
-void Track::export_to_wave_file(const char* filename, IProgressMonitor& monitor) const
+void Track::export_to_wave_file(const char* filename, IProgressMonitor& monitor, ExportFormat format) const
 {
     SF_INFO sfinfo;
     sfinfo.samplerate=get_samplerate();
     sfinfo.channels=1;
-    sfinfo.format=SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+
+    switch (format) {
+    case ExportFormat::Wave16:
+        sfinfo.format=SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+        break;
+    case ExportFormat::Wave24:
+        sfinfo.format=SF_FORMAT_WAV | SF_FORMAT_PCM_24;
+        break;
+    case ExportFormat::WaveFloat:
+        sfinfo.format=SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+        break;
+    case ExportFormat::FLAC:
+        sfinfo.format=SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+        break;
+    case ExportFormat::Raw:
+        sfinfo.format=SF_FORMAT_RAW | SF_FORMAT_FLOAT | SF_ENDIAN_LITTLE;
+        break;
+    }
 
     SNDFILE* sf=sf_open(filename, SFM_WRITE, &sfinfo);
-    if (!sf) return;
+    if (!sf)
+        throw std::runtime_error(sf_strerror(nullptr));
+
+    // saturate rather than wrap around when converting to integer samples
+    sf_command(sf, SFC_SET_CLIPPING, nullptr, SF_TRUE);
+
+    // grains are clipped to segment boundaries, so segments can be rendered independently and in any order
+    constexpr long segmentlength=65536;
+
+    /* Render a consistent version of the synth frames even if the track is edited meanwhile, which is why the chunks
+     * must not be accessed here, as exporting runs on a thread of its own. */
+    const auto frames=get_synth_frames();
+    if (!frames)
+        throw std::runtime_error("Synth frames have not been computed");
+    const int firstframe=frames->find(frames->get_begin());
+
+    const long begin =lrint((*frames)[firstframe].tbegin());
+    const long length=lrint(frames->get_end());
+    const long nsegments=(length + segmentlength - 1) / segmentlength;
+
+    // how far grains extend from their centers bounds the range of frames which may overlap a segment
+    float reachleft=0.0f, reachright=0.0f;
+    for (auto it=frames->cursor(firstframe), last=frames->cursor(frames->size()); it!=last; ++it) {
+        reachleft =std::max(reachleft,  it->left);
+        reachright=std::max(reachright, it->right);
+    }
+
+    auto find_frame=[&frames, firstframe](double t) {
+        return std::max(frames->find(t), firstframe);
+    };
+
+    const int nthreads=std::clamp<long>(std::thread::hardware_concurrency(), 1, std::max(nsegments, 1L));
+
+    std::vector<std::vector<float>> segments(nsegments);
+    std::vector<bool>               finished(nsegments);
+    std::mutex                      mutex;
+    std::condition_variable         cond;
+    long                            nextsegment=0;
+    long                            written=0;
+
+    // workers may run ahead of the writer by a bounded number of segments only
+    const long maxahead=4*nthreads;
+
+    auto job=[&]() {
+        for (;;) {
+            long k;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                if (nextsegment==nsegments)
+                    return;
+
+                k=nextsegment++;
+                cond.wait(lock, [&]() { return k<written+maxahead; });
+            }
+
+            const long from=begin + k*segmentlength;
+            const long to  =std::min(from+segmentlength, begin+length);
 
-    long length=lrint(lastchunk->end);
-    long ptr=0;
+            std::vector<float> buffer(to-from, 0.0f);
+            render_synth_frames(*wave, *frames, find_frame(from-reachright), find_frame(to+reachleft), buffer.data(), from, to, Waveform::Interpolation::Sinc);
 
-    auto renderer=create_render_audio_provider(*this, firstchunk, lastchunk);
+            std::lock_guard<std::mutex> lock(mutex);
+            segments[k]=std::move(buffer);
+            finished[k]=true;
+            cond.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i=0;i<nthreads;i++)
+        threads.emplace_back(job);
+
+    /* Write the segments in order as they become available, which overlaps encoding and file I/O with rendering.
+     * After a write error, the remaining segments are only waited for, so that the workers can finish. */
+    bool failed=false;
 
-    while (ptr<length) {
-        monitor.report((double) ptr/length);
+    for (long k=0;k<nsegments;k++) {
+        monitor.report((double) k/nsegments);
 
-        float buffer[1024];
-        long count=renderer->provide(buffer, 1024);
-        if (!count) return;
+        std::vector<float> buffer;
 
-        sf_write_float(sf, buffer, count);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]() { return bool(finished[k]); });
+
+            buffer=std::move(segments[k]);
+        }
 
-        ptr+=count;
+        if (!failed && sf_write_float(sf, buffer.data(), buffer.size())!=(sf_count_t) buffer.size())
+            failed=true;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        written=k+1;
+        cond.notify_all();
+    }
+
+    for (auto& thread: threads)
+        thread.join();
+
+    if (failed) {
+        std::string error=sf_strerror(sf);
+        sf_close(sf);
+
+        throw std::runtime_error(error);
     }
 
     sf_close(sf);
 
     monitor.report(1.0);
-
-    for (auto& s: synth)
-        printf("at %.4f: %.1f / %.1f (vol=%.3f)\n", s.tmid/get_samplerate(), s.tmid-s.tbegin, s.tend-s.tmid, s.amplitude);
 }
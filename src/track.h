@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
+#include <utility>
 #include "waveform.h"
 
 
@@ -33,20 +35,161 @@ public:
         }
     };
 
+    // synthesis frame, stored relative to its window center in the output waveform to keep it compact
     struct SynthFrame {
-        double  smid;       // window center in original waveform
-        double  tbegin;     // window begin in output waveform
         double  tmid;       // window center in output waveform
-        double  tend;       // window end in output waveform
-        float   stretch;    // time scaling factor
+        float   soffset;    // window center in original waveform, relative to tmid
+        float   left;       // window length before center
+        float   right;      // window length after center
         float   amplitude;  // amplitude scaling factor
+
+        double smid() const
+        {
+            return tmid + soffset;
+        }
+
+        double tbegin() const
+        {
+            return tmid - left;
+        }
+
+        double tend() const
+        {
+            return tmid + right;
+        }
+    };
+
+    /* The synth frames of a track, kept as the frames of its independent runs, i.e. of each run of voiced chunks and
+     * each unvoiced chunk. Runs are shared between versions as long as their chunks are not edited, so that a new
+     * version only allocates the frames of the edited runs, besides the table of runs. Frames are still indexed
+     * across all runs, in the order of their centers. */
+    class SynthFrames {
+    public:
+        typedef std::vector<SynthFrame> Run;
+
+        SynthFrames(std::vector<std::shared_ptr<const Run>>&& runs, double begin, double end);
+
+        // a copy of other in which the runs centered in [rangebegin, rangeend) are replaced by the given ones
+        SynthFrames(const SynthFrames& other, double rangebegin, double rangeend, std::vector<std::shared_ptr<const Run>>&& runs);
+
+        int size() const
+        {
+            return count;
+        }
+
+        // for random access, as this searches the table of runs; sequential walks are cheaper with a Cursor
+        const SynthFrame& operator[](int i) const
+        {
+            assert(0<=i && i<count);
+
+            const Entry& entry=runs[find_entry(i)];
+            return (*entry.run)[i - entry.first];
+        }
+
+        // walks the frames in order, locating the run of a frame only once
+        class Cursor {
+            const SynthFrames*  frames=nullptr;
+            int                 index=0;
+            int                 entry=0;    // run containing the frame, or the last run at the end
+
+        public:
+            Cursor() {}
+            Cursor(const SynthFrames& frames, int index):frames(&frames), index(index), entry(frames.find_entry(index)) {}
+
+            int get_index() const
+            {
+                return index;
+            }
+
+            const SynthFrame& operator*() const
+            {
+                assert(0<=index && index<frames->count);
+                const Entry& e=frames->runs[entry];
+                return (*e.run)[index - e.first];
+            }
+
+            const SynthFrame* operator->() const
+            {
+                return &**this;
+            }
+
+            Cursor& operator++()
+            {
+                if (++index<frames->count && index-frames->runs[entry].first==(int) frames->runs[entry].run->size())
+                    entry++;
+
+                return *this;
+            }
+
+            bool operator==(const Cursor& rhs) const
+            {
+                return index==rhs.index;
+            }
+
+            bool operator!=(const Cursor& rhs) const
+            {
+                return index!=rhs.index;
+            }
+
+            bool operator<(const Cursor& rhs) const
+            {
+                return index<rhs.index;
+            }
+        };
+
+        Cursor cursor(int i) const
+        {
+            return Cursor(*this, i);
+        }
+
+        // index of the first frame centered at or after t
+        int find(double t) const;
+
+        // span of the centers of all runs with frames centered on both sides of or within [begin, end), if any
+        std::pair<double, double> get_run_span(double begin, double end) const;
+
+        // time span of the chunks the frames have been computed from, which edits leave unchanged
+        double get_begin() const
+        {
+            return begin;
+        }
+
+        double get_end() const
+        {
+            return end;
+        }
+
+    private:
+        struct Entry {
+            std::shared_ptr<const Run>  run;
+            int                         first;  // index of its first frame
+        };
+
+        std::vector<Entry>  runs;   // never empty ones
+        int                 count=0;
+
+        double              begin;
+        double              end;
+
+        void append(std::shared_ptr<const Run>);
+
+        // index of the run containing frame i, or of the last run if i is past the end
+        int find_entry(int i) const
+        {
+            auto it=std::upper_bound(runs.begin(), runs.end(), i, [] (int i, const Entry& entry) {
+                return i < entry.first;
+            });
+
+            return std::max(int(it-runs.begin()) - 1, 0);
+        }
     };
 
     // synthesis chunk
     struct Chunk {
-        Chunk*  prev=nullptr;
-        Chunk*  next=nullptr;
-        Chunk*  backup=nullptr;
+        int     slot=-1;    // own index in the chunk table
+        int     prev=-1;    // links are chunk table indices, -1 if none
+        int     next=-1;
+        int     backup=-1;
 
         int     beginframe;
         int     endframe;
@@ -64,13 +207,53 @@ public:
         void serialize(Archive& ar, uint32_t ver);
     };
 
+    /* Chunks are kept in fixed-size blocks, so that both their indices and their addresses remain
+     * stable while the table grows. Blocks are contiguous, hence linear scans over the table are
+     * cache-friendly, and released slots are recycled. */
+    class ChunkTable {
+        static constexpr int    blockbits=8;
+        static constexpr int    blocksize=1<<blockbits;
+
+        std::vector<std::unique_ptr<Chunk[]>>   blocks;
+        std::vector<int>                        freeslots;
+        int                                     count=0;
+
+    public:
+        Chunk& operator[](int slot)
+        {
+            assert(0<=slot && slot<count);
+            return blocks[slot>>blockbits][slot&(blocksize-1)];
+        }
+
+        const Chunk& operator[](int slot) const
+        {
+            assert(0<=slot && slot<count);
+            return blocks[slot>>blockbits][slot&(blocksize-1)];
+        }
+
+        Chunk* allocate(const Chunk& init);
+        void release(Chunk*);
+    };
+
+    /* Replacement of a run of consecutive chunks by another one, which is how edits are recorded in the journal.
+     * Chunks are referred to by their position in the track, as their slots are not stored in project files. */
+    struct Edit {
+        int                 first;  // position of the first chunk replaced
+        int                 count;  // number of chunks replaced
+        std::vector<Chunk>  chunks;
+
+        template<typename Archive>
+        void serialize(Archive& ar, uint32_t ver);
+    };
+
     class PitchContourIterator {
+        Track*  track;
         Chunk*  chunk;
         int     index;
 
     public:
-        PitchContourIterator(std::nullptr_t):chunk(nullptr), index(0) {}
-        PitchContourIterator(Chunk* chunk, int index):chunk(chunk), index(index) {}
+        PitchContourIterator(std::nullptr_t):track(nullptr), chunk(nullptr), index(0) {}
+        PitchContourIterator(Track& track, Chunk* chunk, int index):track(&track), chunk(chunk), index(index) {}
 
         HermiteSplinePoint* operator->()
         {
@@ -119,7 +302,7 @@ public:
             while (result.index>=result.chunk->pitchcontour.size()) {
                 result.index-=result.chunk->pitchcontour.size();
 
-                result.chunk=result.chunk->next;
+                result.chunk=result.track->get_next_chunk(result.chunk);
                 if (!result.chunk) break;
                 if (!result.chunk->voiced) {
                     result.chunk=nullptr;
@@ -138,7 +321,7 @@ public:
 
             result.index-=rhs;
             while (result.index<0) {
-                result.chunk=result.chunk->prev;
+                result.chunk=result.track->get_prev_chunk(result.chunk);
                 if (!result.chunk) break;
                 if (!result.chunk->voiced) {
                     result.chunk=nullptr;
@@ -153,16 +336,65 @@ public:
     };
 
 
+    /* Piecewise cubic coefficients of the pitch contour across a run of voiced chunks, from the given control point
+     * on, for fast repeated evaluation. Synthesis, hit testing and drawing all evaluate the contour through this. */
+    class PitchContourSpline {
+        std::vector<double>                 knots;      // begin time of each segment but the first
+        std::vector<HermiteInterpolation>   segments;
+
+        double                              begin;      // times of the first and the last control point
+        double                              end;
+
+    public:
+        PitchContourSpline(PitchContourIterator first);
+
+        double get_begin() const
+        {
+            return begin;
+        }
+
+        double get_end() const
+        {
+            return end;
+        }
+
+        // evaluates at any time, searching for its segment
+        float operator()(double t) const;
+
+        // evaluates at a time not before the one of the previous call with the same segment index
+        float operator()(double t, int& segment) const
+        {
+            while (segment<int(knots.size()) && t>=knots[segment])
+                segment++;
+
+            return segments[segment](t);
+        }
+
+        // evaluates at n ascending times
+        void evaluate(float* out, const double* t, int n) const;
+    };
+
     Track() {}
     Track(std::shared_ptr<Waveform>);
-    ~Track();
 
     void detect_chunks();
     void compute_pitch_contour();
 
     void compute_synth_frames();
+    // returns the time span of the output affected by the recomputation
+    std::pair<double, double> compute_synth_frames(Chunk* first, Chunk* last);
+    // computes the frames for the voiced runs containing the given chunks without storing them, returning the time span of these runs
+    std::pair<double, double> compute_synth_frames(std::vector<SynthFrame>& frames, Chunk* first, Chunk* last);
+
+    enum class ExportFormat {
+        Wave16,
+        Wave24,
+        WaveFloat,
+        FLAC,
+        Raw         // headerless little-endian 32-bit float
+    };
 
-    void export_to_wave_file(const char* filename, IProgressMonitor&) const;
+    void export_to_wave_file(const char* filename, IProgressMonitor&, ExportFormat=ExportFormat::Wave16) const;
 
     int get_samplerate() const
     {
@@ -174,23 +406,106 @@ public:
         return *wave;
     }
 
+    std::shared_ptr<const Waveform> get_shared_waveform() const
+    {
+        return wave;
+    }
+
+    // project files store the waveform apart from the track, to be attached once read
+    void set_waveform(std::shared_ptr<Waveform> w)
+    {
+        wave=std::move(w);
+    }
+
+    /* Synth frames are never modified once published, but replaced as a whole, so that the returned snapshot
+     * may be used from other threads while editing goes on. Until they are first computed, there are none, and
+     * edits do not bother to update them. */
+    std::shared_ptr<const SynthFrames> get_synth_frames() const
+    {
+        return std::atomic_load(&synth);
+    }
+
+    // for use on the thread editing the track only
+    bool has_synth_frames() const
+    {
+        return synth!=nullptr;
+    }
+
     const SynthFrame& get_synth_frame(int i) const
     {
-        return synth[i];
+        return (*synth)[i];
     }
 
     int get_synth_frame_count() const
     {
-        return synth.size();
+        return synth ? synth->size() : 0;
     }
 
-    int get_first_synth_frame_index(const Track::Chunk*) const;
+    Chunk* get_chunk(int slot)
+    {
+        return slot>=0 ? &chunks[slot] : nullptr;
+    }
+
+    const Chunk* get_chunk(int slot) const
+    {
+        return slot>=0 ? &chunks[slot] : nullptr;
+    }
+
+    Chunk* get_first_chunk()
+    {
+        return get_chunk(firstchunk);
+    }
+
+    const Chunk* get_first_chunk() const
+    {
+        return get_chunk(firstchunk);
+    }
+
+    Chunk* get_last_chunk()
+    {
+        return get_chunk(lastchunk);
+    }
+
+    const Chunk* get_last_chunk() const
+    {
+        return get_chunk(lastchunk);
+    }
+
+    Chunk* get_prev_chunk(const Chunk* chunk)
+    {
+        return get_chunk(chunk->prev);
+    }
+
+    const Chunk* get_prev_chunk(const Chunk* chunk) const
+    {
+        return get_chunk(chunk->prev);
+    }
 
-    Chunk*  get_first_chunk()
+    Chunk* get_next_chunk(const Chunk* chunk)
     {
-        return firstchunk;
+        return get_chunk(chunk->next);
     }
 
+    const Chunk* get_next_chunk(const Chunk* chunk) const
+    {
+        return get_chunk(chunk->next);
+    }
+
+    // returns the chunk containing the given time, or nullptr if there is none
+    Chunk* find_chunk(double t);
+
+    // position of a chunk in the track, counting from zero
+    int get_chunk_position(const Chunk*) const;
+
+    int get_chunk_count() const
+    {
+        return chunkorder.size();
+    }
+
+    // describes the replacement of count chunks by the run from first to last, which is already in place
+    Edit make_edit(const Chunk* first, const Chunk* last, int count) const;
+    void apply_edit(const Edit&);
+
     static void update_akima_slope(const HermiteSplinePoint* p0, HermiteSplinePoint* p1, HermiteSplinePoint* p2, HermiteSplinePoint* p3, const HermiteSplinePoint* p4);
 
     template<typename Archive>
@@ -210,10 +525,19 @@ private:
 
     std::shared_ptr<Waveform>   wave;
 
-    std::vector<SynthFrame>     synth;
+    std::shared_ptr<const SynthFrames>  synth;
+
+    ChunkTable                  chunks;
+    int                         firstchunk=-1;
+    int                         lastchunk =-1;
 
-    Chunk*                      firstchunk=nullptr;
-    Chunk*                      lastchunk =nullptr;
+    // slots of all chunks currently in the list, in temporal order, for binary search
+    std::vector<int>            chunkorder;
+
+    void update_chunk_order();
 
     void compute_pitch_contour(Chunk* chunk, int from, int to);
+
+    void extend_to_runs(Chunk*& first, Chunk*& last);
+    Chunk* compute_synth_frames(std::vector<SynthFrame>& frames, Chunk* chunk);
 };
@@ -1,5 +1,12 @@
+#include <stdio.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <new>
+#include <thread>
 #include <sndfile.h>
 #include "waveform.h"
 #include "correlation.h"
@@ -13,15 +20,282 @@ T sqr(T x)
 }
 
 
+Waveform::Waveform()
+{
+}
+
+
 Waveform::Waveform(long length, int samplerate):length(length), samplerate(samplerate)
 {
-    data=new float[length];
+    data=allocate(length);
+}
+
+
+/* Blocks are claimed by the first thread to fetch them, and other threads fetching a block being decoded wait for
+ * it. Once a block is done, its state is the only thing ever read again, so checking it needs no lock. Blocks
+ * which failed to decode are done as well, but hold silence. */
+struct Waveform::Decoding {
+    enum State:uint8_t {
+        Pending,
+        Busy,
+        Done,
+        Failed
+    };
+
+    std::unique_ptr<IBlockDecoder>      decoder;
+    long                                blocklength;
+
+    std::vector<std::atomic<uint8_t>>   states;
+    long                                remaining;
+    std::atomic<bool>                   complete=false;
+
+    std::mutex                          mutex;
+    std::condition_variable             cond;
+
+    std::thread                         prefetcher;
+    std::atomic<bool>                   stopping=false;
+
+    void decode(float* data, long length, long block);
+};
+
+
+Waveform::IBlockDecoder::~IBlockDecoder()
+{
+}
+
+
+Waveform::Waveform(long length, int samplerate, std::vector<Frame>&& frames, std::unique_ptr<IBlockDecoder> decoder):
+    length(length),
+    samplerate(samplerate),
+    frames(std::move(frames))
+{
+    data=allocate(length);
+
+    decoding=std::make_unique<Decoding>();
+    decoding->decoder=std::move(decoder);
+    decoding->blocklength=decoding->decoder->get_block_length();
+    decoding->remaining=(length + decoding->blocklength - 1) / decoding->blocklength;
+
+    decoding->states=std::vector<std::atomic<uint8_t>>(decoding->remaining);
+    for (auto& state: decoding->states)
+        state=Decoding::Pending;
+
+    decoding->complete=decoding->remaining==0;
+}
+
+
+Waveform::Waveform(const float* data, long length, int samplerate, std::vector<Frame>&& frames, std::shared_ptr<const void> storage):
+    data(const_cast<float*>(data)),
+    length(length),
+    samplerate(samplerate),
+    frames(std::move(frames)),
+    storage(std::move(storage))
+{
 }
 
 
 Waveform::~Waveform()
 {
-    delete[] data;
+    if (decoding) {
+        decoding->stopping=true;
+
+        if (decoding->prefetcher.joinable())
+            decoding->prefetcher.join();
+    }
+
+    if (!storage)
+        release(data);
+}
+
+
+void Waveform::Decoding::decode(float* data, long length, long block)
+{
+    uint8_t expected=Pending;
+
+    if (states[block].compare_exchange_strong(expected, Busy)) {
+        const long begin=block*blocklength;
+        const long count=std::min(blocklength, length-begin);
+
+        // silence is better than noise, and the failure is recorded for fetching strictly
+        const bool decoded=decoder->decode(data+begin, block, count);
+        if (!decoded)
+            std::fill(data+begin, data+begin+count, 0.0f);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        states[block].store(decoded ? Done : Failed, std::memory_order_release);
+
+        if (--remaining==0)
+            complete.store(true, std::memory_order_release);
+
+        cond.notify_all();
+    }
+    else if (expected==Busy) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this, block]() { return states[block].load(std::memory_order_acquire)>=Done; });
+    }
+}
+
+
+void Waveform::fetch(long begin, long end, bool strict) const
+{
+    if (!decoding)
+        return;
+
+    const bool complete=decoding->complete.load(std::memory_order_acquire);
+    if (complete && !strict)
+        return;
+
+    const long first=std::max(begin, 0L) / decoding->blocklength;
+    const long last =(std::min<long>(end, length) + decoding->blocklength - 1) / decoding->blocklength;
+
+    for (long i=first;i<last;i++) {
+        if (!complete)
+            decoding->decode(data, length, i);
+
+        if (strict && decoding->states[i].load(std::memory_order_acquire)==Decoding::Failed)
+            throw std::runtime_error("Corrupt sample data at offset " + std::to_string(i*decoding->blocklength));
+    }
+}
+
+
+bool Waveform::is_available(long begin, long end) const
+{
+    if (!decoding || decoding->complete.load(std::memory_order_acquire))
+        return true;
+
+    const long first=std::max(begin, 0L) / decoding->blocklength;
+    const long last =(std::min<long>(end, length) + decoding->blocklength - 1) / decoding->blocklength;
+
+    for (long i=first;i<last;i++)
+        if (decoding->states[i].load(std::memory_order_acquire)<Decoding::Done)
+            return false;
+
+    return true;
+}
+
+
+void Waveform::prefetch()
+{
+    if (!decoding || decoding->prefetcher.joinable())
+        return;
+
+    decoding->prefetcher=std::thread([this]() {
+        for (long i=0; i<(long) decoding->states.size() && !decoding->stopping; i++)
+            decoding->decode(data, length, i);
+    });
+}
+
+
+float* Waveform::allocate(int64_t length)
+{
+    float* buffer=static_cast<float*>(::operator new[]((length + 2*guard) * sizeof(float), std::align_val_t(alignment)));
+    std::fill(buffer, buffer + length + 2*guard, 0.0f);
+
+    return buffer + guard;
+}
+
+
+void Waveform::release(float* data)
+{
+    if (data)
+        ::operator delete[](data - guard, std::align_val_t(alignment));
+}
+
+
+// accumulates the convolution with a short kernel, one tap at a time so that the inner loop vectorizes
+template<int Taps>
+static void convolve(float* out, const float* in, const float* coeffs, long count)
+{
+    for (long j=0;j<count;j++)
+        out[j]=0.0f;
+
+    for (int k=0;k<Taps;k++)
+        for (long j=0;j<count;j++)
+            out[j]+=coeffs[k]*in[j+k];
+}
+
+
+void Waveform::interpolate(float* out, long offset, float frac, long count, Interpolation mode) const
+{
+    // the fractional offset is the same for all samples, so the interpolation kernel is computed only once
+    float coeffs[8];
+    int taps, first;
+
+    switch (mode) {
+    default:
+    case Interpolation::Linear:
+        taps=2;
+        first=0;
+
+        coeffs[0]=1.0f-frac;
+        coeffs[1]=frac;
+        break;
+    case Interpolation::Cubic:
+        taps=4;
+        first=-1;
+
+        coeffs[0]=((-frac + 2.0f)*frac - 1.0f)*frac * 0.5f;
+        coeffs[1]=((3.0f*frac - 5.0f)*frac*frac + 2.0f) * 0.5f;
+        coeffs[2]=((-3.0f*frac + 4.0f)*frac + 1.0f)*frac * 0.5f;
+        coeffs[3]=(frac - 1.0f)*frac*frac * 0.5f;
+        break;
+    case Interpolation::Sinc: {
+        taps=8;
+        first=-3;
+
+        float sum=0.0f;
+
+        for (int k=0;k<taps;k++) {
+            const float d=float(first+k) - frac;
+
+            coeffs[k]=d==0.0f ? 1.0f : 4.0f * sinf(M_PI*d) * sinf(M_PI*d/4) / float(M_PI*M_PI*d*d);
+            sum+=coeffs[k];
+        }
+
+        // normalize for unity gain at DC
+        for (int k=0;k<taps;k++)
+            coeffs[k]/=sum;
+
+        break;
+    }
+    }
+
+    const long start=offset + first;
+
+    // outputs whose stencil lies entirely within the waveform and its guard samples can be computed without bounds checks
+    const long lo=std::clamp(-guard - start, 0L, count);
+    const long hi=std::clamp(length + guard - taps + 1 - start, lo, count);
+
+    auto interpolate_checked=[&] (long j) {
+        float sum=0.0f;
+
+        for (int k=0;k<taps;k++)
+            if (start+j+k>=0 && start+j+k<length)
+                sum+=coeffs[k]*data[start+j+k];
+
+        out[j]=sum;
+    };
+
+    for (long j=0;j<lo;j++)
+        interpolate_checked(j);
+
+    for (long j=hi;j<count;j++)
+        interpolate_checked(j);
+
+    if (hi==lo) return;
+
+    switch (taps) {
+    case 2:
+        convolve<2>(out+lo, data+start+lo, coeffs, hi-lo);
+        break;
+    case 4:
+        convolve<4>(out+lo, data+start+lo, coeffs, hi-lo);
+        break;
+    case 8:
+        convolve<8>(out+lo, data+start+lo, coeffs, hi-lo);
+        break;
+    }
 }
 
 
@@ -21,8 +21,29 @@ public:
         void serialize(Archive& ar, uint32_t ver);
     };
 
-    Waveform() {}
+    enum class Interpolation {
+        Linear,
+        Cubic,      // Catmull-Rom spline
+        Sinc        // Lanczos windowed sinc with 8 taps
+    };
+
+    // decodes sample data stored in blocks which can be decoded independently of each other
+    class IBlockDecoder {
+    public:
+        virtual ~IBlockDecoder();
+
+        virtual long get_block_length() const = 0;
+
+        // may be called concurrently for different blocks, returning false if the data is corrupt
+        virtual bool decode(float* out, long block, long count) const = 0;
+    };
+
+    Waveform();
     Waveform(long length, int samplerate);
+    // the sample data is decoded once needed, see fetch()
+    Waveform(long length, int samplerate, std::vector<Frame>&& frames, std::unique_ptr<IBlockDecoder> decoder);
+    // refers to sample data padded with guard samples, such as in a mapped file, which is kept alive by storage
+    Waveform(const float* data, long length, int samplerate, std::vector<Frame>&& frames, std::shared_ptr<const void> storage);
     ~Waveform();
 
     float operator[](long offset) const
@@ -31,20 +52,69 @@ public:
         return data[offset];
     }
 
+    // linearly interpolated sample at a fractional offset, see interpolate() for higher quality resampling
     float operator()(double offset) const
     {
         long ptr=(long) floor(offset);
         float t=float(offset-ptr);
 
-        // TODO: cubic interpolation
-        if (ptr<0)
-            return ptr<-1 ? 0.0f : data[0]*t;
-        else if (ptr+1>=length)
-            return ptr>=length ? 0.0f : data[ptr]*(1.0f-t);
-        else
-            return data[ptr]*(1.0f-t) + data[ptr+1]*t;
+        // the guard samples take care of the stencil straddling either end of the waveform
+        if (ptr<-guard || ptr+1>=length+guard)
+            return 0.0f;
+
+        return data[ptr]*(1.0f-t) + data[ptr+1]*t;
     }
 
+    // read-only view of the sample data, which may be indexed up to guard samples beyond either end
+    class Samples {
+        const float*    data;
+        int64_t         length;
+
+    public:
+        Samples(const float* data, int64_t length):data(data), length(length) {}
+
+        float operator[](long offset) const
+        {
+            assert(-guard<=offset && offset<length+guard);
+            return data[offset];
+        }
+
+        const float* begin() const
+        {
+            return data;
+        }
+
+        const float* end() const
+        {
+            return data+length;
+        }
+
+        int64_t size() const
+        {
+            return length;
+        }
+    };
+
+    Samples get_samples() const
+    {
+        return Samples(data, length);
+    }
+
+    /* Sample data which is decoded lazily must be fetched before it is accessed. Fetching decodes whatever is
+     * missing in the given range, or waits for other threads decoding it. This is safe from any thread, and
+     * returns right away once everything has been decoded. Corrupt sample data is replaced by silence, which
+     * is fine for playback, but when strict, fetching throws if the range contains any. */
+    void fetch(long begin, long end, bool strict=false) const;
+
+    // whether the given range can be accessed without fetching it, which never waits so that the audio thread may call it
+    bool is_available(long begin, long end) const;
+
+    // starts decoding all sample data in the background
+    void prefetch();
+
+    // resamples count consecutive samples starting at offset+frac, with samples outside the waveform taken to be zero
+    void interpolate(float* out, long offset, float frac, long count, Interpolation) const;
+
     int64_t get_length() const
     {
         return length;
@@ -73,14 +143,26 @@ public:
     template<typename Archive>
     void load(Archive& ar, uint32_t);
 
-    template<typename Archive>
-    void save(Archive& ar, uint32_t) const;
+    // number of zero samples padding the sample data on either side, chosen to preserve alignment
+    static constexpr long   guard=16;
 
 private:
-    float*  data=nullptr;
+    static constexpr size_t alignment=64;
+
+    static float* allocate(int64_t length);
+    static void release(float* data);
+
+    float*  data=nullptr;   // points past the leading guard samples
     int64_t length=0;
     int32_t samplerate=0;
 
     std::vector<Frame>  frames;
+
+    // owner of the sample data if not allocated by the waveform itself
+    std::shared_ptr<const void> storage;
+
+    // state of lazy decoding, if any
+    struct Decoding;
+    std::unique_ptr<Decoding>   decoding;
 };
 